@@ -0,0 +1,195 @@
+#include "at_parser.h"
+
+#include <stdint.h>
+
+
+// Largest value that can still take one more digit without overflow.
+#define FIELD_VALUE_LIMIT   ((INT32_MAX - 9) / 10)
+
+
+void AtLineParser::start(const AtLineSchema *schema, int32_t *fields)
+{
+    this->schema = schema;
+    this->fields = fields;
+    result = PARSING;
+
+    state = PREFIX;
+    prefixPos = 0;
+    linePos = 0;
+    fieldIndex = 0;
+    negative = false;
+    value = 0;
+}
+
+AtLineParser::Result AtLineParser::feed(char c)
+{
+    if( result != PARSING )
+    {
+        return result;
+    }
+
+    if( linePos < UINT8_MAX )
+    {
+        linePos++;
+    }
+
+    switch( state )
+    {
+    case PREFIX:
+        if( c == schema->prefix[prefixPos] )
+        {
+            prefixPos++;
+            if( schema->prefix[prefixPos] == '\0' )
+            {
+                state = schema->numFields ? FIELD_START : FIELD_END;
+            }
+        }
+        else if( prefixPos == 0 && (c == '\r' || c == '\n') )
+        {
+            // Empty line or leftover of previous line ending.
+            linePos = 0;
+        }
+        else if( c == '\n' )
+        {
+            prefixPos = 0;
+            linePos = 0;
+        }
+        else
+        {
+            state = SKIP_LINE;
+        }
+        break;
+
+    case SKIP_LINE:
+        if( c == '\n' )
+        {
+            state = PREFIX;
+            prefixPos = 0;
+            linePos = 0;
+        }
+        break;
+
+    case FIELD_START:
+        if( c >= '0' && c <= '9' )
+        {
+            value = c - '0';
+            state = FIELD_DIGITS;
+        }
+        else if( c == '-' || c == '+' )
+        {
+            negative = (c == '-');
+            state = FIELD_SIGN;
+        }
+        else if( c != ' ' )
+        {
+            result = MALFORMED;
+        }
+        break;
+
+    case FIELD_SIGN:
+        if( c >= '0' && c <= '9' )
+        {
+            value = c - '0';
+            state = FIELD_DIGITS;
+        }
+        else
+        {
+            result = MALFORMED;
+        }
+        break;
+
+    case FIELD_DIGITS:
+        if( c >= '0' && c <= '9' )
+        {
+            if( value > FIELD_VALUE_LIMIT )
+            {
+                result = MALFORMED;
+                break;
+            }
+            value = value*10 + (c - '0');
+        }
+        else
+        {
+            fields[fieldIndex++] = negative ? -value : value;
+            negative = false;
+            value = 0;
+            fieldSeparator(c);
+        }
+        break;
+
+    case FIELD_END:
+        fieldSeparator(c);
+        break;
+
+    case LINE_END:
+        if( c == '\n' )
+        {
+            finishLine();
+        }
+        else
+        {
+            result = MALFORMED;
+        }
+        break;
+    }
+
+    return result;
+}
+
+AtLineParser::Result AtLineParser::parse(const LineView &line)
+{
+    uint8_t len = line.length();
+
+    for(uint8_t i = 0; i < len && result == PARSING; i++)
+    {
+        feed(line.at(i));
+    }
+
+    // Line view doesn't contain line ending, so terminate the line here.
+    feed('\n');
+
+    if( result == PARSING )
+    {
+        result = MALFORMED;
+    }
+
+    return result;
+}
+
+void AtLineParser::fieldSeparator(char c)
+{
+    switch( c )
+    {
+    case ' ':
+        state = FIELD_END;
+        break;
+
+    case ',':
+        if( fieldIndex < schema->numFields )
+        {
+            state = FIELD_START;
+        }
+        else
+        {
+            result = MALFORMED;
+        }
+        break;
+
+    case '\r':
+        state = LINE_END;
+        break;
+
+    case '\n':
+        finishLine();
+        break;
+
+    default:
+        result = MALFORMED;
+        break;
+    }
+}
+
+void AtLineParser::finishLine(void)
+{
+    result = (fieldIndex == schema->numFields) ? PARSED : MALFORMED;
+}
@@ -0,0 +1,116 @@
+#ifndef __AT_PARSER_H__
+#define __AT_PARSER_H__
+
+#include "at_process.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/**
+ * @brief Layout of a response or URC line: a prefix followed by comma
+ *        separated integer fields, like "^READCHAR: 4,1".
+ */
+struct AtLineSchema
+{
+    const char *prefix;  /*!< Line prefix, including ':' if there is one. */
+    uint8_t numFields;   /*!< Exact number of integer fields after prefix. */
+};
+
+
+/**
+ * @brief Single pass parser of lines described with @ref AtLineSchema . It
+ *        takes one character at a time, so it can parse a line in place from
+ *        @ref LineView , or directly from a stream of received characters,
+ *        see @ref charHandler . Lines that don't start with the prefix are
+ *        skipped. Line that starts with the prefix but has missing, extra or
+ *        invalid fields is reported as malformed.
+ */
+class AtLineParser
+{
+public:
+    enum Result
+    {
+        PARSING,  /*!< Line with the prefix wasn't completely received yet. */
+        PARSED,   /*!< All fields are parsed. */
+        MALFORMED /*!< Line with the prefix doesn't follow the schema. */
+    };
+
+    AtLineParser() : schema(NULL), fields(NULL), result(MALFORMED) {}
+
+    /**
+     * @brief Start parsing a new line.
+     *
+     * @param schema Layout of the expected line.
+     * @param fields Array of at least schema->numFields values where parsed
+     *               fields are stored.
+     */
+    void start(const AtLineSchema *schema, int32_t *fields);
+
+    /**
+     * @brief Feed one character to the parser. After the line is parsed or
+     *        found malformed, following characters are ignored.
+     *
+     * @param c Next character.
+     * @return Result Parsing status after this character.
+     */
+    Result feed(char c);
+
+    /**
+     * @brief Parse a complete line. Line that ends before the parsing is done
+     *        is malformed.
+     *
+     * @param line View of the line.
+     * @return Result PARSED or MALFORMED.
+     */
+    Result parse(const LineView &line);
+
+    /**
+     * @brief Parsing status of the current line.
+     */
+    inline Result status(void) { return result; }
+
+    /**
+     * @brief Position in the line where parsing stopped, useful when reporting
+     *        malformed lines.
+     */
+    inline uint8_t position(void) { return linePos; }
+
+    /**
+     * @brief Character handler that can be passed to AtProcess, with parser
+     *        as its context, to parse response while it is received.
+     */
+    static void charHandler(char c, void *context)
+    {
+        ((AtLineParser*)context)->feed(c);
+    }
+
+private:
+    enum State
+    {
+        PREFIX,       /*!< Matching the line prefix. */
+        SKIP_LINE,    /*!< Line has other prefix, waiting for its end. */
+        FIELD_START,  /*!< Spaces or sign before field digits. */
+        FIELD_SIGN,   /*!< Sign received, digit must follow. */
+        FIELD_DIGITS, /*!< Receiving field digits. */
+        FIELD_END,    /*!< Spaces after a field. */
+        LINE_END      /*!< '\r' received, waiting for '\n'. */
+    };
+
+    void fieldSeparator(char c);
+    void finishLine(void);
+
+    const AtLineSchema *schema;
+    int32_t *fields;
+    Result result;
+
+    State state;
+    uint8_t prefixPos;
+    uint8_t linePos;
+    uint8_t fieldIndex;
+    bool negative;
+    int32_t value;
+};
+
+
+#endif//__AT_PARSER_H__
@@ -5,43 +5,130 @@
 #include <string.h>
 
 
-static int8_t substringInCharStream(char c,
-                                    uint8_t numSubstrings,
-                                    const char **substrings,
-                                    uint8_t *foundLen
-)
+#define RX_RING_MASK                        (AT_RX_RING_B - 1)
+
+
+bool LineView::matches(uint8_t pos, const char *str, uint8_t strLen) const
+{
+    if( (uint16_t)pos + strLen > length() )
+    {
+        return false;
+    }
+
+    // Part of the string that falls into the first segment.
+    uint8_t first = pos < len ? len - pos : 0;
+    first = first < strLen ? first : strLen;
+
+    return memcmp(&ptr[pos], str, first) == 0 &&
+           memcmp(&wrapPtr[pos + first - len], &str[first], strLen - first) == 0;
+}
+
+bool LineView::startsWith(const char *str) const
+{
+    return matches(0, str, strlen(str));
+}
+
+int16_t LineView::find(char c, uint8_t from) const
 {
-    int8_t foundSubstring = -1;
+    const char *found = NULL;
 
-    for(uint32_t i = 0; i < numSubstrings; i++)
+    if( from < len )
     {
-        if( c == substrings[i][foundLen[i]] )
+        found = (const char*)memchr(&ptr[from], c, len - from);
+        if( found )
         {
-            foundLen[i]++;
+            return found - ptr;
         }
-        else
+        from = len;
+    }
+
+    if( from < length() )
+    {
+        found = (const char*)memchr(&wrapPtr[from - len], c, length() - from);
+        if( found )
         {
-            foundLen[i] = 0;
+            return len + (found - wrapPtr);
         }
+    }
+
+    return -1;
+}
 
-        if( substrings[i][foundLen[i]] == '\0' )
+int16_t LineView::find(const char *str, uint8_t from) const
+{
+    uint8_t strLen = strlen(str);
+    int16_t pos = from;
+
+    while( strLen && (pos = find(str[0], pos)) >= 0 )
+    {
+        if( matches(pos, str, strLen) )
         {
-            foundSubstring = i;
-            break;
+            return pos;
         }
+        pos++;
     }
 
-    return foundSubstring;
+    return -1;
 }
 
+int32_t LineView::toInt(uint8_t from, uint8_t *end) const
+{
+    int32_t value = 0;
+    bool negative = false;
 
-void AtProcess::init(AtProcessInit *s)
+    for(; from < length() && at(from) == ' '; from++);
+
+    if( from < length() && (at(from) == '-' || at(from) == '+') )
+    {
+        negative = at(from++) == '-';
+    }
+
+    for(; from < length() && at(from) >= '0' && at(from) <= '9'; from++)
+    {
+        value = value*10 + (at(from) - '0');
+    }
+
+    if( end )
+    {
+        *end = from;
+    }
+
+    return negative ? -value : value;
+}
+
+uint8_t LineView::copy(char *buff, uint32_t buffSize) const
 {
-    Timeout::init(pMillis);
+    uint8_t copied = 0;
+
+    if( buffSize )
+    {
+        copied = length() < buffSize - 1 ? length() : buffSize - 1;
+
+        uint8_t first = copied < len ? copied : len;
+        memcpy(buff, ptr, first);
+        memcpy(&buff[first], wrapPtr, copied - first);
+        buff[copied] = '\0';
+    }
+
+    return copied;
+}
+
 
+void AtProcess::init(AtProcessInit *s)
+{
     cmdEnding = s->cmdEnding;
     cmdAck = s->cmdAck;
     cmdError = s->cmdError;
+    cmdAckLen = cmdAck ? strlen(cmdAck) : 0;
+    cmdErrorLen = cmdError ? strlen(cmdError) : 0;
+
+    urcTable = s->urcTable;
+    numUrcs = s->urcTable ? s->numUrcs : 0;
+    urcTableContext = s->urcContext;
+
+    rxRd = rxScan = rxWr;
+    rxDiscard = false;
+    clearResponseLine();
 }
 
 uint32_t AtProcess::sendCommand(const char *cmd)
@@ -52,47 +139,822 @@ uint32_t AtProcess::sendCommand(const char *cmd)
     return charsPrinted;
 }
 
-uint32_t AtProcess::waitURC(const char *urc, char *lineBuff, uint32_t lineBuffSize, uint32_t timeout)
+uint32_t AtProcess::sendCommand(char *cmd, uint32_t cmdLen, uint32_t cmdBuffSize)
+{
+    uint32_t endingLen = strlen(cmdEnding);
+
+    if( cmdLen + endingLen >= cmdBuffSize )
+    {
+        return sendCommand(cmd);
+    }
+
+    memcpy(&cmd[cmdLen], cmdEnding, endingLen);
+    uint32_t charsPrinted = write((const uint8_t*)cmd, cmdLen + endingLen);
+    cmd[cmdLen] = '\0';
+
+    return charsPrinted;
+}
+
+void AtProcess::setUrcHandler(LineHandler *handler, void *context)
+{
+    urcHandler = handler;
+    urcContext = context;
+}
+
+void AtProcess::startResponse(
+    const char *echo,
+    char *responseBuff, uint32_t responseBuffSize,
+    uint32_t timeout,
+    bool waitOk,
+    uint8_t *dataBuff, uint32_t dataSize,
+    CharHandler *cHandler, void *handlerContext
+)
+{
+    respStatus.status = IN_PROGRESS;
+    respStatus.echoReceived = false;
+    respStatus.errorReceived = false;
+    respStatus.responseLen = 0;
+    respStatus.dataLen = 0;
+    respStatus.dataTotal = 0;
+    respStatus.urcLines = 0;
+    clearResponseLine();
+
+    this->waitOk = waitOk;
+    respBuff = responseBuffSize ? responseBuff : NULL;
+    respBuffSize = responseBuffSize;
+    this->dataBuff = dataBuff;
+    this->dataSize = dataBuff ? dataSize : 0;
+    dataLeft = 0;
+    bodyLines = 0;
+    respCharHandler = cHandler;
+    respCharContext = handlerContext;
+
+    // Single response replaces anything that might still be in flight. Owners
+    // of dropped queued responses learn that they failed.
+    while( pipelineLen )
+    {
+        PipelineEntry &dropped = pipeline[pipelineHead];
+
+        pipelineHead = (pipelineHead + 1) % AT_PIPELINE_MAX_DEPTH;
+        pipelineLen--;
+
+        if( dropped.queued && doneHandler )
+        {
+            doneHandler(dropped.ticket, GEN_ERROR, doneContext);
+        }
+    }
+    pipelineBytes = 0;
+    pushPipeline(echo, 0, timeout, false);
+
+    if( respBuff )
+    {
+        respBuff[0] = '\0';
+    }
+
+    parserState = echo ? PARSER_ECHO : PARSER_BODY;
+
+    respDeadline.restart(timeout, gapTimeout);
+}
+
+int8_t AtProcess::queueResponse(const char *echo, uint32_t bytes, uint32_t timeout)
+{
+    int8_t ticket = -1;
+
+    if( pipelineLen == 0 )
+    {
+        startResponse(echo, NULL, 0, timeout);
+
+        PipelineEntry &head = pipeline[pipelineHead];
+        head.queued = true;
+        head.bytes = bytes;
+        pipelineBytes = bytes;
+        ticket = head.ticket;
+    }
+    else if( pipelineLen < AT_PIPELINE_MAX_DEPTH )
+    {
+        ticket = pushPipeline(echo, bytes, timeout, true);
+    }
+
+    return ticket;
+}
+
+void AtProcess::setDoneHandler(DoneHandler *handler, void *context)
+{
+    doneHandler = handler;
+    doneContext = context;
+}
+
+void AtProcess::setIdleHandler(IdleHandler *handler, void *context)
+{
+    idleHandler = handler;
+    idleContext = context;
+}
+
+void AtProcess::setFrameHandler(uint8_t sync, uint16_t maxBodyLen,
+                                FrameHandler *handler, void *context)
 {
-    uint32_t recvLen = 0;
+    frameSync = sync;
+    frameMaxLen = maxBodyLen;
+    frameHandler = handler;
+    frameContext = context;
+    frameLeft = 0;
+}
 
-    struct URCContext
+void AtProcess::waitInput(int32_t timeout)
+{
+    if( idleHandler )
     {
-        const char *urc;
-        uint8_t urcFoundLen;
-        int8_t foundUrc;
-    } context = { urc,
-                  0,
-                  -1
-    };
+        idleHandler(idleContext);
+
+        timeout = timeout < AT_IDLE_PERIOD_MS ? timeout : AT_IDLE_PERIOD_MS;
+    }
 
-    CharHandler *responseChecker = [](char c, void* handlerContext)
+    if( pWaitRx )
+    {
+        pWaitRx(timeout > 0 ? timeout : 1);
+    }
+    else
     {
-        URCContext *pContext = (URCContext*)handlerContext;
+        delay(1);
+    }
+}
+
+int8_t AtProcess::pushPipeline(const char *echo, uint32_t bytes, uint32_t timeout, bool queued)
+{
+    PipelineEntry &entry = pipeline[(pipelineHead + pipelineLen) % AT_PIPELINE_MAX_DEPTH];
 
-        // Check if we have already found one of substrings.
-        if( pContext->foundUrc < 0 )
+    // Echo buffer belongs to the caller, keep what is needed to match it.
+    entry.echoLen = 0;
+    entry.echoSignature = 5381;
+    if( echo )
+    {
+        for(; echo[entry.echoLen]; entry.echoLen++)
         {
-            pContext->foundUrc =
-                substringInCharStream(c,
-                                      1,
-                                      &pContext->urc,
-                                      &pContext->urcFoundLen);
+            if( entry.echoLen < AT_ECHO_KEEP_B )
+            {
+                entry.echo[entry.echoLen] = echo[entry.echoLen];
+            }
+            entry.echoSignature = signature(entry.echoSignature, echo[entry.echoLen]);
         }
-    };
+    }
+    entry.ticket = nextTicket;
+    entry.echoReceived = false;
+    entry.queued = queued;
+    entry.bytes = bytes;
+    entry.timeout = timeout;
+
+    nextTicket = (nextTicket + 1) & 0x7F;
+    pipelineLen++;
+    pipelineBytes += bytes;
+
+    return entry.ticket;
+}
+
+void AtProcess::activateHead(void)
+{
+    PipelineEntry &head = pipeline[pipelineHead];
+
+    respStatus.status = IN_PROGRESS;
+    respStatus.echoReceived = head.echoReceived;
+    respStatus.errorReceived = false;
+    respStatus.responseLen = 0;
+    respStatus.dataLen = 0;
+    respStatus.dataTotal = 0;
+    respStatus.urcLines = 0;
+    clearResponseLine();
+
+    waitOk = true;
+    respBuff = NULL;
+    respBuffSize = 0;
+    dataBuff = NULL;
+    dataSize = 0;
+    dataLeft = 0;
+    bodyLines = 0;
+    respCharHandler = NULL;
+    respCharContext = NULL;
+
+    parserState = head.echoReceived ? PARSER_BODY : PARSER_ECHO;
+
+    respDeadline.restart(head.timeout, gapTimeout);
+}
+
+bool AtProcess::matchQueuedEcho(const LineView &line)
+{
+    for(uint8_t i = 1; i < pipelineLen; i++)
+    {
+        PipelineEntry &entry = pipeline[(pipelineHead + i) % AT_PIPELINE_MAX_DEPTH];
+
+        if( !entry.echoReceived && isEcho(entry, line) )
+        {
+            entry.echoReceived = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool AtProcess::isEcho(const PipelineEntry &entry, const LineView &line)
+{
+    // Echo is recognised by its beginning, module can append to it.
+    if( !entry.echoLen || line.length() < entry.echoLen )
+    {
+        return false;
+    }
+
+    uint16_t lineSignature = 5381;
+    for(uint8_t i = 0; i < entry.echoLen; i++)
+    {
+        if( i < AT_ECHO_KEEP_B && line.at(i) != entry.echo[i] )
+        {
+            return false;
+        }
+        lineSignature = signature(lineSignature, line.at(i));
+    }
+
+    return lineSignature == entry.echoSignature;
+}
+
+bool AtProcess::feed(char c)
+{
+    if( !rxFree() )
+    {
+        releaseResponseLine();
+    }
+
+    if( rxFree() )
+    {
+        rxRing[rxWr++ & RX_RING_MASK] = c;
+    }
+
+    uint32_t consumed = 0;
+
+    return consumeRing(&consumed);
+}
+
+uint32_t AtProcess::process(void)
+{
+    uint32_t processed = 0;
+    uint16_t received = 0;
+
+    // Stop right after the last response in flight, following characters
+    // are left in the ring for whoever reads next. One call reads at most a
+    // ring worth of input, so input that never stops can't block the caller
+    // past its deadline.
+    while( !(consumeRing(&processed) && parserState == PARSER_IDLE) &&
+           received < AT_RX_RING_B )
+    {
+        uint16_t got = fillRing();
+
+        if( !got )
+        {
+            break;
+        }
+
+        received += got;
+        processed += got;
+    }
+
+    return processed;
+}
+
+AtProcess::Status AtProcess::poll(void)
+{
+    pump();
+
+    return respStatus.status;
+}
+
+void AtProcess::discardInput(void)
+{
+    releaseResponseLine();
+
+    frameLeft = 0;
 
     do
     {
-        recvLen = getLine(lineBuff, lineBuffSize-1, timeout, responseChecker, &context);
+        rxRd = rxScan = rxWr;
+        rxDiscard = false;
+    }while( fillRing() );
+}
+
+AtProcess::Status AtProcess::waitResponse(void)
+{
+    while( respStatus.status == IN_PROGRESS )
+    {
+        if( !pump() )
+        {
+            waitInput(respDeadline.remaining());
+        }
+    }
+
+    return respStatus.status;
+}
+
+bool AtProcess::pump(void)
+{
+    bool received = process() > 0;
+
+    if( respStatus.status == IN_PROGRESS )
+    {
+        if( received )
+        {
+            respDeadline.touch();
+        }
 
-        if( context.foundUrc == 0 )
+        // Checked even while bytes keep coming, so a noisy line can't hold
+        // the response open past its deadline.
+        if( respDeadline.expired() )
+        {
+            finishResponse(TIMEOUT);
+        }
+    }
+
+    return received;
+}
+
+bool AtProcess::consumeRing(uint32_t *consumed)
+{
+    bool completed = false;
+
+    while( rxRd != rxWr && !(completed && parserState == PARSER_IDLE) )
+    {
+        if( parserState == PARSER_DATA )
+        {
+            // Binary data is copied in bulk, it doesn't go through the parser.
+            uint16_t chunkLen = rxBuffered() < dataLeft ? rxBuffered() : dataLeft;
+            uint32_t room = dataSize - respStatus.dataLen;
+            uint16_t toCopy = chunkLen < room ? chunkLen : room;
+
+            ringCopy(&dataBuff[respStatus.dataLen], toCopy);
+            respStatus.dataLen += toCopy;
+
+            // What doesn't fit in the buffer is dropped.
+            rxRd += chunkLen - toCopy;
+
+            *consumed += chunkLen;
+            dataLeft -= chunkLen;
+
+            if( !dataLeft )
+            {
+                parserState = PARSER_BODY;
+            }
+
+            continue;
+        }
+
+        if( frameLeft )
+        {
+            // Frame body is handed over as it arrives.
+            uint16_t chunkLen = rxBuffered() < frameLeft ? rxBuffered() : frameLeft;
+
+            frameChunk(chunkLen);
+            *consumed += chunkLen;
+
+            continue;
+        }
+
+        if( (int16_t)(rxScan - rxRd) < 0 )
+        {
+            rxScan = rxRd;
+        }
+
+        // Frame can start only where a line would.
+        if( frameHandler && rxScan == rxRd && !rxDiscard &&
+            (uint8_t)rxRing[rxRd & RX_RING_MASK] == frameSync )
+        {
+            if( rxBuffered() < 3 )
+            {
+                break;
+            }
+
+            if( frameStart() )
+            {
+                *consumed += 3;
+                continue;
+            }
+        }
+
+        uint16_t lineEnd;
+
+        if( rxDiscard )
+        {
+            // Rest of a too long line is dropped up to its end.
+            bool found = ringFind('\n', rxRd, rxWr, &lineEnd);
+            uint16_t dropped = found ? lineEnd + 1 - rxRd : rxBuffered();
+
+            rxRd += dropped;
+            *consumed += dropped;
+            rxDiscard = !found;
+
+            continue;
+        }
+
+        if( !ringFind('\n', rxScan, rxWr, &lineEnd) )
+        {
+            rxScan = rxWr;
+
+            if( rxBuffered() < MAX_LINE_LEN_B - 1 )
+            {
+                break;
+            }
+
+            // Line doesn't fit, process what we have and drop the rest.
+            lineEnd = rxRd + MAX_LINE_LEN_B - 2;
+            rxDiscard = true;
+        }
+
+        uint16_t lineStart = rxRd;
+        uint16_t lineLen = lineEnd + 1 - lineStart;
+        LineView line = ringView(lineStart, lineLen);
+
+        rxRd = rxScan = lineEnd + 1;
+        *consumed += lineLen;
+
+        if( lineReceived(line) )
+        {
+            completed = true;
+        }
+    }
+
+    return completed;
+}
+
+bool AtProcess::frameStart(void)
+{
+    uint16_t bodyLen = (uint8_t)rxRing[(rxRd + 1) & RX_RING_MASK] |
+                       (uint16_t)(uint8_t)rxRing[(rxRd + 2) & RX_RING_MASK] << 8;
+
+    if( bodyLen == 0 || bodyLen > frameMaxLen )
+    {
+        return false;
+    }
+
+    rxRd = rxScan = rxRd + 3;
+    frameLen = frameLeft = bodyLen;
+
+    return true;
+}
+
+void AtProcess::frameChunk(uint16_t chunkLen)
+{
+    uint16_t pos = rxRd & RX_RING_MASK;
+    uint16_t first = AT_RX_RING_B - pos;
+    uint16_t offset = frameLen - frameLeft;
+
+    first = first < chunkLen ? first : chunkLen;
+
+    frameHandler((const uint8_t*)&rxRing[pos], first, offset, frameLen, frameContext);
+
+    if( first < chunkLen )
+    {
+        frameHandler((const uint8_t*)rxRing, chunkLen - first, offset + first,
+                     frameLen, frameContext);
+    }
+
+    rxRd = rxScan = rxRd + chunkLen;
+    frameLeft -= chunkLen;
+}
+
+LineView AtProcess::ringView(uint16_t start, uint16_t len)
+{
+    LineView view;
+    uint16_t pos = start & RX_RING_MASK;
+    uint16_t first = AT_RX_RING_B - pos;
+
+    first = first < len ? first : len;
+
+    view.ptr = &rxRing[pos];
+    view.len = first;
+    view.wrapPtr = rxRing;
+    view.wrapLen = len - first;
+
+    return view;
+}
+
+bool AtProcess::ringFind(char c, uint16_t from, uint16_t to, uint16_t *found)
+{
+    // At most two memchr calls, one for each side of the wrap.
+    while( from != to )
+    {
+        uint16_t pos = from & RX_RING_MASK;
+        uint16_t len = AT_RX_RING_B - pos;
+        len = len < (uint16_t)(to - from) ? len : (uint16_t)(to - from);
+
+        const char *match = (const char*)memchr(&rxRing[pos], c, len);
+        if( match )
+        {
+            *found = from + (match - &rxRing[pos]);
+            return true;
+        }
+
+        from += len;
+    }
+
+    return false;
+}
+
+uint16_t AtProcess::ringCopy(uint8_t *buff, uint16_t amount)
+{
+    amount = amount < rxBuffered() ? amount : rxBuffered();
+
+    LineView view = ringView(rxRd, amount);
+    memcpy(buff, view.ptr, view.len);
+    memcpy(&buff[view.len], view.wrapPtr, view.wrapLen);
+
+    rxRd += amount;
+
+    return amount;
+}
+
+uint16_t AtProcess::fillRing(void)
+{
+    uint16_t received = 0;
+
+    // Response line is given up only if it blocks new input.
+    if( !rxFree() )
+    {
+        releaseResponseLine();
+    }
+
+    while( rxFree() )
+    {
+        uint16_t pos = rxWr & RX_RING_MASK;
+        uint16_t space = AT_RX_RING_B - pos;
+        space = space < rxFree() ? space : rxFree();
+
+        uint16_t got = 0;
+
+        if( pSerRead )
+        {
+            got = pSerRead((uint8_t*)&rxRing[pos], space);
+        }
+        else
+        {
+            for(; got < space && serGet(&rxRing[pos + got]); got++);
+        }
+
+        rxWr += got;
+        received += got;
+
+        if( got < space )
         {
             break;
         }
+    }
+
+    return received;
+}
+
+int8_t AtProcess::matchUrc(const LineView &line)
+{
+    int8_t urc = -1;
+    uint8_t urcLen = 0;
+
+    // URC prefix counts only if it is at the beginning of a line. Longest
+    // matching prefix wins, so one prefix can extend another.
+    for(uint8_t i = 0; i < numUrcs; i++)
+    {
+        const char *prefix = urcTable[i].prefix;
+        uint8_t len = 0;
+
+        while( prefix[len] && len < line.length() && line.at(len) == prefix[len] )
+        {
+            len++;
+        }
+
+        if( !prefix[len] && len > urcLen )
+        {
+            urc = i;
+            urcLen = len;
+        }
+    }
+
+    return urc;
+}
+
+bool AtProcess::isTerminator(const LineView &line, const char *pattern, uint8_t patternLen)
+{
+    if( !patternLen )
+    {
+        return false;
+    }
+
+    if( pattern[0] == '\n' )
+    {
+        return line.length() == patternLen - 1 && line.matches(0, &pattern[1], patternLen - 1);
+    }
+
+    return line.length() >= patternLen &&
+           line.matches(line.length() - patternLen, pattern, patternLen);
+}
+
+bool AtProcess::lineReceived(const LineView &line)
+{
+    if( pOutput || (respCharHandler && parserState != PARSER_IDLE) )
+    {
+        for(uint8_t i = 0; i < line.length(); i++)
+        {
+            char c = line.at(i);
+            char lastCharOutput[2] = {c, '\0'};
+            output(lastCharOutput);
+
+            if( respCharHandler && parserState != PARSER_IDLE )
+            {
+                respCharHandler(c, respCharContext);
+            }
+        }
+    }
+
+    int8_t urc = matchUrc(line);
+
+    // URCs with a table handler can come at any time, the rest of '^' lines
+    // are URCs only if they don't belong to a response.
+    bool urcLine = isHandledUrc(urc) ||
+                   (line.at(0) == '^' &&
+                    (parserState == PARSER_IDLE || parserState == PARSER_ECHO));
+
+    if( parserState == PARSER_IDLE )
+    {
+        if( urcLine )
+        {
+            dispatchUrc(line, urc);
+        }
+
+        return false;
+    }
+
+    if( parserState == PARSER_ECHO && isEcho(pipeline[pipelineHead], line) )
+    {
+        respStatus.echoReceived = true;
+        pipeline[pipelineHead].echoReceived = true;
+        parserState = PARSER_BODY;
+        appendResponse(line);
+    }
+    else if( matchQueuedEcho(line) )
+    {
+        // Echo of a queued command, it is not a part of this response.
+    }
+    else if( urcLine )
+    {
+        respStatus.urcLines++;
+        dispatchUrc(line, urc);
+    }
+    else
+    {
+        appendResponse(line);
+
+        if( parserState == PARSER_BODY && respStatus.echoReceived )
+        {
+            bodyLines++;
+
+            // First non empty line is kept in the ring for in place parsing.
+            if( !respLineFound && line.at(0) != '\r' && line.at(0) != '\n' )
+            {
+                respLine = line;
+                respLinePin = rxRd - line.length();
+                respLineFound = true;
+                respLinePinned = true;
+            }
+
+            // Binary data follows the first line after the echo, which
+            // tells its length. ERROR has no length and no data.
+            int32_t dataLen = bodyLines == 1 && dataBuff ? lineDataLength(line) : 0;
+
+            if( dataLen > 0 )
+            {
+                respStatus.dataTotal = dataLen;
+                dataLeft = dataLen;
+                parserState = PARSER_DATA;
+            }
+        }
+    }
+
+    if( isTerminator(line, cmdAck, cmdAckLen) )
+    {
+        return finishResponse(respStatus.errorReceived ? GEN_ERROR : SUCCESS);
+    }
+    else if( isTerminator(line, cmdError, cmdErrorLen) )
+    {
+        if( waitOk )
+        {
+            respStatus.errorReceived = true;
+        }
+        else
+        {
+            return finishResponse(GEN_ERROR);
+        }
+    }
+
+    return false;
+}
+
+int32_t AtProcess::lineDataLength(const LineView &line)
+{
+    int32_t length = -1;
+    uint16_t i = 0;
+
+    // Length is the first field, after the prefix if there is one.
+    int16_t colon = line.find(':');
+    if( colon >= 0 )
+    {
+        i = colon + 1;
+    }
+
+    for(; i < line.length() && line.at(i) == ' '; i++);
+
+    for(; i < line.length() && line.at(i) >= '0' && line.at(i) <= '9' &&
+          length < 0xFFFFFF; i++)
+    {
+        length = (length < 0 ? 0 : length * 10) + (line.at(i) - '0');
+    }
+
+    return length;
+}
+
+bool AtProcess::isHandledUrc(int8_t urc)
+{
+    return urc >= 0 && urc < numUrcs && urcTable[urc].handler;
+}
+
+void AtProcess::dispatchUrc(const LineView &line, int8_t urc)
+{
+    if( wantedUrc && line.find(wantedUrc) >= 0 )
+    {
+        if( wantedUrcBuff )
+        {
+            line.copy(wantedUrcBuff, wantedUrcBuffSize);
+        }
+        wantedUrcLen = line.length();
+        wantedUrc = NULL;
+    }
+    else if( isHandledUrc(urc) )
+    {
+        urcTable[urc].handler(line, urc, urcTableContext);
+    }
+    else if( urcHandler )
+    {
+        urcHandler(line, urc, urcContext);
+    }
+}
+
+bool AtProcess::finishResponse(Status status)
+{
+    respStatus.status = status;
+    parserState = PARSER_IDLE;
+
+    if( pipelineLen )
+    {
+        PipelineEntry &done = pipeline[pipelineHead];
+
+        pipelineBytes -= done.bytes;
+        pipelineHead = (pipelineHead + 1) % AT_PIPELINE_MAX_DEPTH;
+        pipelineLen--;
+
+        if( done.queued && doneHandler )
+        {
+            doneHandler(done.ticket, status, doneContext);
+        }
+
+        if( pipelineLen )
+        {
+            activateHead();
+        }
+    }
 
-    }while(recvLen);
+    return true;
+}
+
+void AtProcess::appendResponse(const LineView &line)
+{
+    if( respBuff && respStatus.responseLen < respBuffSize - 1 )
+    {
+        uint32_t space = respBuffSize - respStatus.responseLen;
 
-    return recvLen;
+        respStatus.responseLen += line.copy(&respBuff[respStatus.responseLen], space);
+    }
+}
+
+uint32_t AtProcess::waitURC(const char *urc, char *lineBuff, uint32_t lineBuffSize, uint32_t timeout)
+{
+    wantedUrc = urc;
+    wantedUrcBuff = lineBuffSize ? lineBuff : NULL;
+    wantedUrcBuffSize = lineBuffSize;
+    wantedUrcLen = 0;
+
+    Timeout urcTimeout(pMillis, timeout);
+
+    while( wantedUrc && urcTimeout.notExpired() )
+    {
+        if( !pump() )
+        {
+            waitInput(urcTimeout.remaining());
+        }
+    }
+
+    wantedUrc = NULL;
+
+    return wantedUrcLen;
 }
 
 uint32_t AtProcess::getLine(
@@ -105,7 +967,7 @@ uint32_t AtProcess::getLine(
     uint32_t lineLen = 0;
     bool timeoutExpired = false;
 
-    Timeout respTimeout(timeout);
+    Deadline lineDeadline(pMillis, timeout, gapTimeout);
     if(!line)
     {
         maxLineLen = MAX_LINE_LEN_B;
@@ -139,14 +1001,14 @@ uint32_t AtProcess::getLine(
                 break;
             }
 
-            respTimeout.restart();
+            lineDeadline.touch();
         }
         else
         {
-            delay(1);
+            waitInput(lineDeadline.remaining());
         }
 
-        timeoutExpired = respTimeout.expired();
+        timeoutExpired = lineDeadline.expired();
     }while(!timeoutExpired);
 
     if( line )
@@ -171,83 +1033,14 @@ AtProcess::Status AtProcess::recvResponse(
     CharHandler *cHandler, void *handlerContext
 )
 {
-    const uint8_t numSubstrings = 2;
-    AtProcess::Status retval = TIMEOUT;
-    uint32_t responseLen = 0;
-
-    struct ResponseContext
-    {
-        const char *substrings[numSubstrings];
-        CharHandler *higherHandler;
-        void *higherContext;
-        uint8_t substringFoundLen[numSubstrings];
-        int8_t foundSubstring;
-    } context = { {cmdAck ? cmdAck : "", cmdError ? cmdError : ""},
-                  cHandler, handlerContext,
-                  {0, 0},
-                  -1
-    };
+    startResponse(NULL,
+                  responseBuff, responseBuffSize,
+                  timeout,
+                  false,
+                  NULL, 0,
+                  cHandler, handlerContext);
 
-    CharHandler *responseChecker = [](char c, void* handlerContext)
-    {
-        ResponseContext *pContext = (ResponseContext*)handlerContext;
-
-        const uint8_t numSubstrings = sizeof(pContext->substrings)/sizeof(char*);
-
-        // Check if we have already found one of substrings.
-        if( pContext->foundSubstring < 0 )
-        {
-            pContext->foundSubstring =
-                substringInCharStream(c,
-                                      numSubstrings,
-                                      pContext->substrings,
-                                      pContext->substringFoundLen);
-        }
-
-        if( pContext->higherHandler )
-        {
-            pContext->higherHandler(c, pContext->higherContext);
-        }
-    };
-
-    uint32_t recvLineLen;
-    do{
-        recvLineLen =
-            getLine(responseBuff ? &responseBuff[responseLen] : NULL,
-                    responseBuffSize - responseLen,
-                    timeout,
-                    responseChecker, &context);
-
-    
-        responseLen += recvLineLen;
-
-        if( context.foundSubstring == 0 )
-        {
-            retval = AtProcess::SUCCESS;
-            break;
-        }
-
-        if( context.foundSubstring == 1 )
-        {
-            retval = AtProcess::GEN_ERROR;
-            break;
-        }
-
-    }while(recvLineLen);
-
-    if( responseBuff )
-    {
-        if( responseLen < responseBuffSize )
-        {
-            responseBuff[responseLen] = '\0';
-        }
-        else
-        {
-            responseBuff[--responseLen] = '\0';
-        }
-    }
-
-    return retval;
+    return waitResponse();
 }
 
 AtProcess::Status AtProcess::recvResponseWaitOk(
@@ -256,29 +1049,14 @@ AtProcess::Status AtProcess::recvResponseWaitOk(
     CharHandler *cHandler, void *handlerContext
 )
 {
-    Status err = recvResponse(timeout, responseBuff, responseBuffSize, cHandler, handlerContext);
-    
-    
-    if( err == GEN_ERROR )
-    {
-        char *additionalResp = NULL;
-
-        if( responseBuff )
-        {
-            uint32_t responseLen = strlen(responseBuff);
-
-            additionalResp = &responseBuff[responseLen];
+    startResponse(NULL,
+                  responseBuff, responseBuffSize,
+                  timeout,
+                  true,
+                  NULL, 0,
+                  cHandler, handlerContext);
 
-            responseBuffSize -= responseLen;
-        }
-
-        if( recvResponse(timeout, additionalResp, responseBuffSize, cHandler, handlerContext) == TIMEOUT )
-        {
-            err = TIMEOUT;
-        }
-    }
-
-    return err;
+    return waitResponse();
 }
 
 AtProcess::Status AtProcess::sendReceive(const char *command, uint32_t timeout, char *responseBuff)
@@ -290,42 +1068,79 @@ AtProcess::Status AtProcess::sendReceive(const char *command, uint32_t timeout,
 
 uint32_t AtProcess::print(const char *str)
 {
-    uint32_t printed;
-
-    for(printed = 0; str[printed] && serPut(str[printed]); printed++);
-
-    return printed;
+    return write((const uint8_t*)str, strlen(str));
 }
 
 uint32_t AtProcess::write(uint8_t data)
 {
     return write(&data, 1);
 }
-uint32_t AtProcess::write(uint8_t *data, uint32_t dataLen)
+uint32_t AtProcess::write(const uint8_t *data, uint32_t dataLen)
 {
-    uint32_t printed;
+    uint32_t printed = 0;
 
-    for(printed = 0; printed < dataLen && serPut(data[printed]); printed++);
+    if( pSerWrite )
+    {
+        printed = pSerWrite(data, dataLen);
+    }
+    else
+    {
+        for(; printed < dataLen && serPut(data[printed]); printed++);
+    }
 
     return printed;
 }
 uint32_t AtProcess::readBytes(uint8_t *buff, uint32_t readAmount)
 {
-    uint32_t readed;
+    // First take what is left in the receive ring.
+    uint32_t readed = ringCopy(buff, readAmount < AT_RX_RING_B ? readAmount : AT_RX_RING_B);
 
-    for(readed = 0; readed < readAmount && serGet((char*)&buff[readed]); readed++);
+    if( pSerRead )
+    {
+        if( readed < readAmount )
+        {
+            readed += pSerRead(&buff[readed], readAmount - readed);
+        }
+    }
+    else
+    {
+        for(; readed < readAmount && serGet((char*)&buff[readed]); readed++);
+    }
 
     return readed;
 }
-uint32_t AtProcess::readBytesBlocking(uint8_t *buff, uint32_t readAmount)
+uint32_t AtProcess::readBytesBlocking(uint8_t *buff, uint32_t readAmount, uint32_t timeout)
 {
-    uint32_t readed;
+    uint32_t readed = 0;
+
+    Deadline readDeadline(pMillis, timeout);
+
+    while( readed < readAmount )
+    {
+        uint32_t received = readBytes(&buff[readed], readAmount - readed);
+        readed += received;
 
-    for(readed = 0; readed < readAmount; readed += serGet((char*)&buff[readed]) ? 1 : 0);
+        if( readed >= readAmount || readDeadline.expired() )
+        {
+            break;
+        }
+
+        if( !received )
+        {
+            waitInput(readDeadline.remaining());
+        }
+    }
 
     return readed;
 }
 bool AtProcess::read(char *c)
 {
-    return serGet(c);
+    bool available = rxBuffered() || fillRing();
+
+    if( available )
+    {
+        *c = rxRing[rxRd++ & RX_RING_MASK];
+    }
+
+    return available;
 }
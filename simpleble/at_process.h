@@ -1,21 +1,140 @@
 #ifndef __AT_PROCESS_H__
 #define __AT_PROCESS_H__
 
+#include "timeout.h"
+
 #include <stdio.h>
 #include <stdint.h>
 
 
+// Longest line that is kept, including terminating '\0' for line copies.
 #define MAX_LINE_LEN_B                      (80+1)
 
+// Commands whose responses can be in flight at once. Each one takes
+// AT_ECHO_KEEP_B + 14 bytes of RAM, so on AVR only one is kept by default.
+#ifndef AT_PIPELINE_MAX_DEPTH
+#if defined(__AVR__)
+#define AT_PIPELINE_MAX_DEPTH               (1)
+#else
+#define AT_PIPELINE_MAX_DEPTH               (4)
+#endif //__AVR__
+#endif //AT_PIPELINE_MAX_DEPTH
+
+// Leading bytes of each command in flight kept to confirm its echo, per
+// pipeline entry. Longer commands have the rest of their echo checked only
+// by signature.
+#ifndef AT_ECHO_KEEP_B
+#define AT_ECHO_KEEP_B                      (36)
+#endif //AT_ECHO_KEEP_B
+
+// Longest time that waiting for input blocks without running idle handler.
+#ifndef AT_IDLE_PERIOD_MS
+#define AT_IDLE_PERIOD_MS                   (10)
+#endif //AT_IDLE_PERIOD_MS
+
+// Receive ring size. It must be a power of two, hold at least one line and be
+// at most 128 bytes, since line views of it have 8-bit lengths.
+#ifndef AT_RX_RING_B
+#define AT_RX_RING_B                        (128)
+#endif //AT_RX_RING_B
+
+static_assert((AT_RX_RING_B & (AT_RX_RING_B - 1)) == 0,
+              "AT_RX_RING_B must be a power of two");
+static_assert(AT_RX_RING_B >= MAX_LINE_LEN_B,
+              "AT_RX_RING_B must hold at least one line");
+static_assert(AT_RX_RING_B <= 128,
+              "AT_RX_RING_B must fit in the 8-bit lengths of LineView");
+
+
+/**
+ * @brief View of a received line, in place inside the AtProcess receive ring.
+ *        Where the ring wraps around, line continues in the second segment.
+ *        Line includes its terminating "\r\n" and it is not null terminated.
+ *        View is valid until more input is processed, or, for the response
+ *        line, until next response is started.
+ */
+struct LineView
+{
+    const char *ptr;     /*!< First segment of the line. */
+    uint8_t len;         /*!< Length of the first segment. */
+    const char *wrapPtr; /*!< Second segment, at the start of the ring. */
+    uint8_t wrapLen;     /*!< Length of the second segment, 0 if none. */
+
+    inline uint8_t length(void) const { return len + wrapLen; }
+    /**
+     * @brief Character at given position, or '\0' past the end of the line.
+     */
+    inline char at(uint8_t i) const
+    {
+        return i < len ? ptr[i] : (i < length() ? wrapPtr[i - len] : '\0');
+    }
+
+    /**
+     * @brief Compare part of the line with a string.
+     *
+     * @param pos Position in line where comparison starts.
+     * @param str String to compare with.
+     * @param strLen Number of characters to compare.
+     * @return true Line contains the string at given position.
+     */
+    bool matches(uint8_t pos, const char *str, uint8_t strLen) const;
+    bool startsWith(const char *str) const;
+
+    /**
+     * @brief Find first occurrence of a character or a string in the line.
+     *
+     * @return int16_t Position of the occurrence, -1 if there is none.
+     */
+    int16_t find(char c, uint8_t from = 0) const;
+    int16_t find(const char *str, uint8_t from = 0) const;
+
+    /**
+     * @brief Parse decimal integer in place. Leading spaces are skipped.
+     *
+     * @param from Position where number starts.
+     * @param end If not NULL, position after the last parsed character.
+     * @return int32_t Parsed number.
+     */
+    int32_t toInt(uint8_t from, uint8_t *end = NULL) const;
+
+    /**
+     * @brief Copy the line to a null terminated string.
+     *
+     * @return uint8_t Number of characters copied, without the terminator.
+     */
+    uint8_t copy(char *buff, uint32_t buffSize) const;
+};
+
 
 typedef void (CharHandler)(char, void*);
+typedef void (LineHandler)(const LineView&, int8_t, void*);
+typedef void (IdleHandler)(void*);
+// Chunk of a frame body, its length, its offset in the body, body length and
+// context.
+typedef void (FrameHandler)(const uint8_t*, uint16_t, uint16_t, uint16_t, void*);
 
 
+/**
+ * @brief Entry of the URC table. Lines that start with a prefix which has a
+ *        handler are URCs wherever they are received, even in the middle of a
+ *        command response, and they are passed to the handler instead of being
+ *        stored in the response. Prefixes without a handler are only
+ *        recognised, their lines stay a part of the response in progress.
+ */
+struct AtUrcEntry
+{
+    const char *prefix;
+    LineHandler *handler;
+};
+
 struct AtProcessInit
 {
     const char *cmdEnding;
     const char *cmdAck;
     const char *cmdError;
+    const AtUrcEntry *urcTable; /*!< Optional table of URC prefixes. */
+    uint8_t numUrcs;
+    void *urcContext;           /*!< Context passed to URC table handlers. */
 };
 
 
@@ -35,7 +154,8 @@ public:
     {
         SUCCESS,
         GEN_ERROR,
-        TIMEOUT
+        TIMEOUT,
+        IN_PROGRESS /*!< Response is still being received, see @ref poll . */
     };
 
     /**
@@ -47,27 +167,93 @@ public:
         URC    /*!< Unsolicated Response Code (wait for one line). */
     };
 
+    /**
+     * @brief Progress of a response that is parsed incrementally, as bytes
+     *        arrive. It is filled in by @ref poll and @ref process .
+     */
+    struct ResponseStatus
+    {
+        Status status;        /*!< IN_PROGRESS until OK, ERROR or timeout. */
+        bool echoReceived;    /*!< Echo of the sent command was received. */
+        bool errorReceived;   /*!< ERROR was received, OK is still awaited. */
+        uint32_t responseLen; /*!< Characters stored in response buffer. */
+        uint32_t dataLen;     /*!< Binary data bytes stored in data buffer. */
+        uint32_t dataTotal;   /*!< Binary data length announced by module. */
+        uint32_t urcLines;    /*!< URC lines received during the response. */
+    };
+
+    /**
+     * @brief Handler called when a response queued with @ref queueResponse
+     *        completes. It gets the ticket returned by @ref queueResponse ,
+     *        final response status and its context.
+     */
+    typedef void (DoneHandler)(int8_t, Status, void*);
+
     /**
      * @brief Construct a new At Process object.
      * 
      * @param uart Reference to previously initialized SerialUART instance.
      * @param delay Pointer to the delay function to use.
      * @param debug Pointer to the debug printout function to use.
+     * @param pSerWrite Optional bulk write function. If NULL, @ref pSerPut is
+     *                  called for each byte.
+     * @param pSerRead Optional non blocking bulk read function, returning the
+     *                 number of bytes read. If NULL, @ref pSerGet is called
+     *                 for each byte.
+     * @param pWaitRx Optional function that blocks until input is available or
+     *                given number of milliseconds passes. If NULL, waiting is
+     *                done with 1 ms delays.
      */
     AtProcess(bool (*const pSerPut)(char),
               bool (*const pSerGet)(char*),
               void (*const pDelay)(uint32_t),
               uint32_t (*const pMillis)(void),
-              void (*const pOutput)(const char *) = NULL) :
+              void (*const pOutput)(const char *) = NULL,
+              uint32_t (*const pSerWrite)(const uint8_t*, uint32_t) = NULL,
+              uint32_t (*const pSerRead)(uint8_t*, uint32_t) = NULL,
+              bool (*const pWaitRx)(uint32_t) = NULL) :
                                                     pSerPut(pSerPut),
                                                     pSerGet(pSerGet),
                                                     pDelay(pDelay),
                                                     pMillis(pMillis),
-                                                    pOutput(pOutput)
-    {}
+                                                    pOutput(pOutput),
+                                                    pSerWrite(pSerWrite),
+                                                    pSerRead(pSerRead),
+                                                    pWaitRx(pWaitRx),
+                                                    rxWr(0),
+                                                    rxRd(0),
+                                                    rxScan(0),
+                                                    rxDiscard(false),
+                                                    parserState(PARSER_IDLE),
+                                                    respDeadline(pMillis, 0),
+                                                    gapTimeout(0),
+                                                    respLinePinned(false),
+                                                    pipelineHead(0),
+                                                    pipelineLen(0),
+                                                    pipelineBytes(0),
+                                                    nextTicket(0),
+                                                    doneHandler(NULL),
+                                                    doneContext(NULL),
+                                                    urcTable(NULL),
+                                                    numUrcs(0),
+                                                    urcTableContext(NULL),
+                                                    urcHandler(NULL),
+                                                    urcContext(NULL),
+                                                    idleHandler(NULL),
+                                                    idleContext(NULL),
+                                                    frameHandler(NULL),
+                                                    frameLeft(0),
+                                                    wantedUrc(NULL)
+    {
+        respStatus.status = SUCCESS;
+        clearResponseLine();
+    }
 
     /**
-     * @brief Initialize AT processor to a known state.
+     * @brief Initialize AT processor to a known state. Response terminators
+     *        must be whole lines ending with '\n'. Terminator that starts with
+     *        '\n' matches only a line equal to the rest of it, otherwise it
+     *        matches the end of any line.
      */
     void init(AtProcessInit *s);
 
@@ -79,6 +265,210 @@ public:
      */
     uint32_t sendCommand(const char *cmd);
 
+    /**
+     * @brief Send an AT command that is stored in a writable buffer. If buffer
+     *        has room for the command ending, ending is put right after the
+     *        command and both go out in one write. Buffer is restored before
+     *        return.
+     * 
+     * @param cmd Buffer with null terminated command.
+     * @param cmdLen Command length, without terminator.
+     * @param cmdBuffSize Size of the command buffer.
+     * @return uint32_t Number of characters successfuly sent.
+     */
+    uint32_t sendCommand(char *cmd, uint32_t cmdLen, uint32_t cmdBuffSize);
+
+    /**
+     * @brief Register a default handler that is called with every complete URC
+     *        line which has no handler in the URC table, and is received while
+     *        no command is in flight, or while we still wait for the command
+     *        echo. Besides the line view, handler gets the index of the URC
+     *        table entry that the line starts with, or -1 if it starts with
+     *        none.
+     * 
+     * @param handler Handler function, or NULL to ignore such URCs.
+     * @param context Context pointer passed to @ref handler .
+     */
+    void setUrcHandler(LineHandler *handler, void *context);
+
+    /**
+     * @brief Prepare response parser for a new command, without blocking.
+     *        Call this before sending the command, and then call @ref poll
+     *        until it stops returning IN_PROGRESS. Responses still queued
+     *        with @ref queueResponse are dropped and reported as GEN_ERROR
+     *        through @ref DoneHandler .
+     * 
+     * @param echo Command whose echo we expect. Lines received before the
+     *             echo that start with '^' are treated as URCs. If NULL no echo
+     *             is expected and all lines are a part of the response.
+     * @param responseBuff Buffer to save the response in. It can be NULL if
+     *                     not used.
+     * @param responseBuffSize Size of the response buffer.
+     * @param timeout Maximum time in milliseconds for the whole response.
+     *                Received characters don't extend it, see
+     *                @ref setGapTimeout .
+     * @param waitOk If ERROR is received keep waiting for the final OK.
+     * @param dataBuff Buffer for binary data that module sends after the first
+     *                 line following the echo, see @ref responseLine . NULL if
+     *                 no data is expected.
+     * @param dataSize Size of data buffer. Data length is the first number in
+     *                 the line before data, like in "^READCHAR: 4,1". Data
+     *                 that doesn't fit in the buffer is received and dropped.
+     * @param cHandler Character handler called on each received character.
+     * @param handlerContext Context pointer that is passed to @ref cHandler .
+     */
+    void startResponse(
+        const char *echo,
+        char *responseBuff = NULL, uint32_t responseBuffSize = 0,
+        uint32_t timeout = 3000,
+        bool waitOk = true,
+        uint8_t *dataBuff = NULL, uint32_t dataSize = 0,
+        CharHandler *cHandler = NULL, void *handlerContext = NULL
+    );
+
+    /**
+     * @brief Queue a response of a command that is sent while previous
+     *        commands are still in flight. Responses are matched to queued
+     *        commands in FIFO order: each OK or ERROR completes the oldest
+     *        command, and echoes are matched to the command they belong to.
+     *        Queued responses are not stored, only their status is reported
+     *        through @ref DoneHandler . If nothing is in flight this starts
+     *        the response right away, like @ref startResponse .
+     * 
+     * @param echo Command whose echo we expect.
+     * @param bytes Number of bytes sent for this command, see @ref bytesInFlight .
+     * @param timeout Maximum time in milliseconds for the response, counted
+     *                from when it becomes the oldest one in flight.
+     * @return int8_t Ticket of the queued response passed later to
+     *                @ref DoneHandler , or -1 if queue is full.
+     */
+    int8_t queueResponse(const char *echo, uint32_t bytes, uint32_t timeout = 3000);
+
+    /**
+     * @brief Set the maximum time between two received characters of a
+     *        response or line. Response that stalls for longer times out
+     *        before its total timeout.
+     * 
+     * @param gap Gap timeout in milliseconds, or 0 to disable it.
+     */
+    inline void setGapTimeout(uint32_t gap) { gapTimeout = gap; }
+
+    /**
+     * @brief Set handler which is called when a queued response completes.
+     * 
+     * @param handler Handler function or NULL.
+     * @param context Context pointer that is passed to @ref handler .
+     */
+    void setDoneHandler(DoneHandler *handler, void *context);
+
+    /**
+     * @brief Number of commands whose response is not yet complete.
+     */
+    inline uint8_t responsesInFlight(void) { return pipelineLen; }
+
+    /**
+     * @brief Number of bytes sent for queued commands that are still in
+     *        flight.
+     */
+    inline uint32_t bytesInFlight(void) { return pipelineBytes; }
+
+    /**
+     * @brief Set handler which is called each time a blocking function waits
+     *        for input.
+     * 
+     * @param handler Handler function or NULL.
+     * @param context Context pointer that is passed to @ref handler .
+     */
+    void setIdleHandler(IdleHandler *handler, void *context);
+
+    /**
+     * @brief Pass binary frames found in the input to a handler instead of
+     *        the line parser. Frame starts at the beginning of a line with the
+     *        sync byte, followed by 16 bit little endian body length and the
+     *        body. Body is handed over in chunks as it arrives, so it doesn't
+     *        have to fit in the receive ring. Sync byte followed by a length of
+     *        0 or above maxBodyLen is treated as a start of a text line.
+     *
+     * @param sync Frame sync byte, it must not start any text line.
+     * @param maxBodyLen Longest valid frame body.
+     * @param handler Handler function, or NULL to disable frames.
+     * @param context Context pointer that is passed to @ref handler .
+     */
+    void setFrameHandler(uint8_t sync, uint16_t maxBodyLen,
+                         FrameHandler *handler, void *context);
+
+    /**
+     * @brief Wait for more input, used by blocking loops when nothing is
+     *        available to process. It runs the idle handler first, and then
+     *        sleeps until input arrives if wait function is provided, or for
+     *        1 ms if it is not.
+     * 
+     * @param timeout Maximum time to wait in milliseconds. Values below 1 are
+     *                treated as 1. If idle handler is set, it is limited to
+     *                AT_IDLE_PERIOD_MS .
+     */
+    void waitInput(int32_t timeout = 1);
+
+    /**
+     * @brief Feed one received character to the response parser.
+     * 
+     * @param c Received character.
+     * @return true Character completed the response in progress.
+     * @return false Response is still not complete, or none is in progress.
+     */
+    bool feed(char c);
+
+    /**
+     * @brief Feed all characters currently available on input communication
+     *        interface to the response parser, without blocking. Input is
+     *        read in blocks into the receive ring and split into lines there.
+     *        It stops right after the response in progress completes, so
+     *        characters following it stay unread in the ring. It reads at most
+     *        one ring worth of input per call.
+     * 
+     * @return uint32_t Number of characters received or processed.
+     */
+    uint32_t process(void);
+
+    /**
+     * @brief Drop all received input that wasn't processed yet, including a
+     *        partial line. Use it when module output can't be trusted, for
+     *        example after reset or UART speed change, so that garbage
+     *        doesn't end up in front of the next line. No response should be
+     *        in progress.
+     */
+    void discardInput(void);
+
+    /**
+     * @brief Non blocking step of response reception. Processes available
+     *        characters and checks for timeout.
+     * 
+     * @return Status IN_PROGRESS while response is not complete, otherwise
+     *                the final response status.
+     */
+    Status poll(void);
+
+    /**
+     * @brief Block until response started with @ref startResponse completes.
+     * 
+     * @return Status Final response status.
+     */
+    Status waitResponse(void);
+
+    /**
+     * @brief Get the progress of the last started response.
+     */
+    inline const ResponseStatus& responseStatus(void) { return respStatus; }
+
+    /**
+     * @brief Get the first non empty line that followed the echo of the last
+     *        started response, usually the one with command results. It stays
+     *        in the receive ring, without a copy, until next response is
+     *        started. Its length is 0 if there was no such line, or if ring
+     *        space was needed for a long burst of other input.
+     */
+    inline const LineView& responseLine(void) { return respLine; }
+
     /**
      * @brief Wait for a specific URC.
      * 
@@ -100,7 +490,7 @@ public:
      * @param maxLineLen Maximum line length that a buffer can store including a
      *                   terminating '\0' character.
      * @param timeout Maximum time that function should wait for a line before
-     *                returning.
+     *                returning. Received characters don't extend it.
      * @param cHandler Character handler function that can be passed by the caller.
      *                 If this parameter is not NULL it will be called on each
      *                 received character, with the character passed to it along
@@ -182,7 +572,7 @@ public:
      * @param dataLen Amount of data in data buffer.
      * @return uint32_t Amount of bytes successfuly sent out.
      */
-    uint32_t write(uint8_t *data, uint32_t dataLen);
+    uint32_t write(const uint8_t *data, uint32_t dataLen);
 
     /**
      * @brief Request arbitrary amount of data from input communication interface,
@@ -196,13 +586,14 @@ public:
     
     /**
      * @brief Request arbitrary amount of data from input communication interface,
-     *        and block until we receive it.
+     *        and block until we receive it or timeout expires.
      * 
      * @param buff Pointer to buffer where input data should be stored.
      * @param readAmount Amount of data requested.
+     * @param timeout Maximum time to wait in milliseconds.
      * @return uint32_t Amount of data actually received into buffer.
      */
-    uint32_t readBytesBlocking(uint8_t *buff, uint32_t readAmount);
+    uint32_t readBytesBlocking(uint8_t *buff, uint32_t readAmount, uint32_t timeout = 3000);
 
     /**
      * @brief Read one character from input communication interface without
@@ -215,6 +606,17 @@ public:
     bool read(char *c);
 
 private:
+    /**
+     * @brief Response parser states.
+     */
+    enum ParserState
+    {
+        PARSER_IDLE, /*!< No command in flight, '^' lines are URCs. */
+        PARSER_ECHO, /*!< Waiting for command echo, '^' lines are URCs. */
+        PARSER_BODY, /*!< Collecting response lines up to OK or ERROR. */
+        PARSER_DATA  /*!< Receiving binary data after the first body line. */
+    };
+
     const char *cmdEnding;
     const char *cmdAck;
     const char *cmdError;
@@ -224,6 +626,126 @@ private:
     void (*const pDelay)(uint32_t);
     uint32_t (*const pMillis)(void);
     void (*const pOutput)(const char *);
+    uint32_t (*const pSerWrite)(const uint8_t*, uint32_t);
+    uint32_t (*const pSerRead)(uint8_t*, uint32_t);
+    bool (*const pWaitRx)(uint32_t);
+
+    // Receive ring. Positions are free running counters, masked on access.
+    char rxRing[AT_RX_RING_B];
+    uint16_t rxWr;   /*!< Next position to write received bytes to. */
+    uint16_t rxRd;   /*!< First byte not consumed yet. */
+    uint16_t rxScan; /*!< First byte not yet searched for line end. */
+    bool rxDiscard;  /*!< Dropping the rest of a too long line. */
+
+    ParserState parserState;
+    ResponseStatus respStatus;
+    Deadline respDeadline;
+    uint32_t gapTimeout;
+    bool waitOk;
+
+    LineView respLine;
+    bool respLineFound;
+    bool respLinePinned;
+    uint16_t respLinePin; /*!< Ring position that can't be overwritten. */
+
+    char *respBuff;
+    uint32_t respBuffSize;
+    uint8_t *dataBuff;
+    uint32_t dataSize;
+    uint32_t dataLeft;
+    uint32_t bodyLines;
+    CharHandler *respCharHandler;
+    void *respCharContext;
+
+    /**
+     * @brief Command whose response is in flight.
+     */
+    struct PipelineEntry
+    {
+        char echo[AT_ECHO_KEEP_B]; /*!< Leading bytes of the echo. */
+        uint16_t echoSignature;
+        uint8_t echoLen;
+        int8_t ticket;
+        bool echoReceived;
+        bool queued;
+        uint32_t bytes;
+        uint32_t timeout;
+    };
+
+    PipelineEntry pipeline[AT_PIPELINE_MAX_DEPTH];
+    uint8_t pipelineHead;
+    uint8_t pipelineLen;
+    uint32_t pipelineBytes;
+    int8_t nextTicket;
+    DoneHandler *doneHandler;
+    void *doneContext;
+
+    uint8_t cmdAckLen;
+    uint8_t cmdErrorLen;
+    const AtUrcEntry *urcTable;
+    uint8_t numUrcs;
+    void *urcTableContext;
+
+    LineHandler *urcHandler;
+    void *urcContext;
+
+    IdleHandler *idleHandler;
+    void *idleContext;
+
+    FrameHandler *frameHandler;
+    void *frameContext;
+    uint8_t frameSync;
+    uint16_t frameMaxLen;
+    uint16_t frameLen;  /*!< Body length of the frame being received. */
+    uint16_t frameLeft; /*!< Body bytes of it that didn't arrive yet. */
+
+    const char *wantedUrc;
+    char *wantedUrcBuff;
+    uint32_t wantedUrcBuffSize;
+    uint32_t wantedUrcLen;
+
+    inline static uint16_t signature(uint16_t sig, char c)
+    {
+        return (uint16_t)((sig << 5) + sig + (uint8_t)c);
+    }
+    inline uint16_t rxBuffered(void) { return rxWr - rxRd; }
+    inline uint16_t rxFree(void)
+    {
+        return AT_RX_RING_B - (uint16_t)(rxWr - (respLinePinned ? respLinePin : rxRd));
+    }
+    inline void releaseResponseLine(void)
+    {
+        respLine.ptr = respLine.wrapPtr = rxRing;
+        respLine.len = respLine.wrapLen = 0;
+        respLinePinned = false;
+    }
+    inline void clearResponseLine(void)
+    {
+        releaseResponseLine();
+        respLineFound = false;
+    }
+
+    bool frameStart(void);
+    void frameChunk(uint16_t chunkLen);
+    LineView ringView(uint16_t start, uint16_t len);
+    bool ringFind(char c, uint16_t from, uint16_t to, uint16_t *found);
+    uint16_t ringCopy(uint8_t *buff, uint16_t amount);
+    uint16_t fillRing(void);
+    bool consumeRing(uint32_t *consumed);
+
+    int8_t pushPipeline(const char *echo, uint32_t bytes, uint32_t timeout, bool queued);
+    void activateHead(void);
+    bool isEcho(const PipelineEntry &entry, const LineView &line);
+    bool matchQueuedEcho(const LineView &line);
+    bool pump(void);
+    int8_t matchUrc(const LineView &line);
+    bool isTerminator(const LineView &line, const char *pattern, uint8_t patternLen);
+    bool lineReceived(const LineView &line);
+    static int32_t lineDataLength(const LineView &line);
+    bool isHandledUrc(int8_t urc);
+    void dispatchUrc(const LineView &line, int8_t urc);
+    bool finishResponse(Status status);
+    void appendResponse(const LineView &line);
 
     inline bool serPut(char c) { if( pSerPut ) return pSerPut(c); else return false; }
     inline bool serGet(char *c) { if( pSerGet ) return pSerGet(c); else return false; }
@@ -11,6 +11,8 @@
 #include <string.h>
 
 #define BASE_SERVER_UUID "91ba0000-b950-4226-aa2b-4ede9fa42f59"
+// Longest time that waitCharUpdate sleeps without running idle handler.
+#define IDLE_PERIOD_MS          (10)
 
 BLEUUID baseUuid(BASE_SERVER_UUID);
 BLEUUID notifyDescUuid((uint16_t)0x2902);
@@ -38,66 +40,55 @@ public:
 class SimpleBLECharCallbacks: public BLECharacteristicCallbacks
 {
 public:
-    SimpleBLECharCallbacks(Esp32Backend* owner) : owner(owner) {}
+    // Each characteristic gets its own callbacks, so they know whose they are
+    // without looking the characteristic up.
+    SimpleBLECharCallbacks(Esp32Backend* owner, uint8_t servIndex, uint8_t charIndex) :
+        owner(owner),
+        servIndex(servIndex),
+        charIndex(charIndex)
+    {}
 
     Esp32Backend* owner;
+    const uint8_t servIndex;
+    const uint8_t charIndex;
 
     void onWrite(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param)
     {
         (void)param;
 
-        BLEUUID charUuid = pCharacteristic->getUUID();
-
-        int8_t servIndex;
-        int8_t charIndex = getServCharIdx(charUuid, servIndex);
-
-        if( charIndex >= 0)
+        // Characteristic with a FIFO is marked as received by the queue.
+        if( !owner->pushCharFifo(servIndex, charIndex,
+                                 pCharacteristic->getData(), pCharacteristic->getLength()) )
         {
             owner->receivedData[servIndex].setFlag(charIndex);
+            owner->pushCharUpdate(servIndex, charIndex, pCharacteristic->getLength());
         }
     }
     void onRead(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param)
     {
+        (void)pCharacteristic;
         (void)param;
 
-        BLEUUID charUuid = pCharacteristic->getUUID();
-
-        int8_t servIndex;
-        int8_t charIndex = getServCharIdx(charUuid, servIndex);
-
-        if( charIndex >= 0)
-        {
-            owner->readData[servIndex].setFlag(charIndex);
-        }
-    }
-
-    int8_t getServCharIdx(BLEUUID& charUuid, int8_t& servIndex)
-    {
-        uint8_t charIndex = -1;
-        for(servIndex = 0; servIndex < owner->servNum; servIndex++)
-        {
-            if( owner->services[servIndex].serv->getCharacteristic(charUuid) != nullptr )
-            {
-                BLEUUID servUuid = owner->services[servIndex].serv->getUUID();
-                const uint8_t uuidLen = servUuid.getNative()->len;
-                charIndex = charUuid.getNative()->uuid.uuid128[uuidLen - 4] -
-                            servUuid.getNative()->uuid.uuid128[uuidLen - 4] -
-                            1;
-                break;
-            }
-        }
-
-        return charIndex;
+        owner->readData[servIndex].setFlag(charIndex);
     }
 };
 
 Esp32Backend::Esp32Backend(const Esp32BackendInterface *ifc) :
     ifc(ifc),
     servNum(0),
-    restartAdvOnDisc(false)
+    restartAdvOnDisc(false),
+    servicesStarted(false),
+    charUpdatesWr(0),
+    charUpdatesRd(0),
+    charUpdatesLost(0),
+    updateSem(NULL),
+    charFifoNum(0),
+    charFifoPoolUsed(0),
+    charFifoLock(NULL),
+    charFifoSpace(NULL),
+    idleHandler(NULL),
+    idleContext(NULL)
 {
-    Timeout::init(ifc->millis);
-
     pServer = NULL;
 }
 
@@ -118,6 +109,17 @@ void Esp32Backend::begin()
 {
     BLEDevice::init("");
 
+    if( !updateSem )
+    {
+        updateSem = xSemaphoreCreateBinary();
+    }
+
+    if( !charFifoLock )
+    {
+        charFifoLock = xSemaphoreCreateMutex();
+        charFifoSpace = xSemaphoreCreateBinary();
+    }
+
     pServer = BLEDevice::createServer();
     pServer->setCallbacks(new SimpleBLEServerCallbacks(this));
 
@@ -140,8 +142,6 @@ bool Esp32Backend::startAdvertisement(uint32_t advPeriodMs,
                                    int32_t advDurationMs,
                                    bool restartOnDisc)
 {
-    static bool servicesStarted = false;
-
     const uint32_t minAdvIntIncrementsUs = 625; // microseconds [us]
 
     bool retval = true;
@@ -236,18 +236,25 @@ bool Esp32Backend::setTxPower(TxPower dbm)
     return retval;
 }
 
-int8_t Esp32Backend::addService(uint8_t servUuid)
+int8_t Esp32Backend::addService(uint8_t servUuid, uint8_t numChars)
 {
     int8_t servIndex = INVALID_SERVICE_INDEX;
 
-    if( servNum < MAX_NUM_SERVICES )
+    if( servNum < MAX_NUM_SERVICES && numChars <= MAX_NUM_CHARS )
     {
         servIndex = servNum;
         servNum++;
         BLEUUID servUuidFull = baseUuid;
         servUuidFull.getNative()->uuid.uuid128[servUuidFull.getNative()->len - 3] = servUuid;
-        services[servIndex].serv = pServer->createService(servUuidFull);
+        // Service declaration, then characteristic declaration, value and
+        // notify descriptor for each characteristic. Default of 15 handles
+        // would only fit a few characteristics.
+        services[servIndex].serv = pServer->createService(servUuidFull,
+                                                          1 + (uint32_t)numChars*3);
         services[servIndex].charNum = 0;
+        services[servIndex].maxChars = numChars;
+        services[servIndex].notifyChars.clear();
+        memset(services[servIndex].fifoIds, 0, sizeof(services[servIndex].fifoIds));
     }
 
     return servIndex;
@@ -271,16 +278,19 @@ int8_t Esp32Backend::addChar(uint8_t serviceIndex, uint32_t maxSize, CharPropFla
 
     bool notifies = (flags & CharPropFlags::NOTIFY) ? true : false ;
 
-    if( serviceIndex < servNum )
+    if( serviceIndex < servNum &&
+        services[serviceIndex].charNum < services[serviceIndex].maxChars )
     {
         charIndex = services[serviceIndex].charNum;
         services[serviceIndex].charNum++;
         BLEUUID charUuid = charUuidFromIndex(serviceIndex, charIndex);
         BLECharacteristic* newChar = services[serviceIndex].serv->createCharacteristic(charUuid, espProps);
-        newChar->setCallbacks(new SimpleBLECharCallbacks(this));
+        services[serviceIndex].chars[charIndex] = newChar;
+        newChar->setCallbacks(new SimpleBLECharCallbacks(this, serviceIndex, charIndex));
         if( notifies )
         {
             newChar->addDescriptor(new BLEDescriptor(notifyDescUuid));
+            services[serviceIndex].notifyChars.setFlag(charIndex);
         }
     }
 
@@ -292,19 +302,47 @@ int32_t Esp32Backend::checkChar(uint8_t serviceIndex, uint8_t charIndex)
     return readChar(serviceIndex, charIndex, NULL, 0);
 }
 
+bool Esp32Backend::makeCharHandle(uint8_t serviceIndex, uint8_t charIndex,
+                                  CharHandle *handle)
+{
+    handle->serviceIndex = serviceIndex;
+    handle->charIndex = charIndex;
+    handle->characteristic = getCharacteristic(serviceIndex, charIndex);
+    handle->notify = handle->characteristic &&
+                     services[serviceIndex].notifyChars.getFlag(charIndex);
+
+    return handle->characteristic != NULL;
+}
+
 int32_t Esp32Backend::readChar(uint8_t serviceIndex, uint8_t charIndex,
                             uint8_t *buff, uint32_t buffSize)
+{
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return readChar(handle, buff, buffSize);
+}
+
+int32_t Esp32Backend::readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize)
 {
     int32_t readBytes = 0;
 
     bool returnData = buff ? true : false ;
 
-    BLECharacteristic* characteristic = getCharacteristic(serviceIndex, charIndex);
+    BLECharacteristic* characteristic = handle.characteristic;
+    CharFifo *fifo = characteristic ? charFifo(handle.serviceIndex, handle.charIndex) : NULL;
 
-    if( characteristic )
+    if( fifo )
+    {
+        readBytes = readCharFifo(handle, fifo, buff, buffSize);
+    }
+    else if( characteristic )
     {
         if( returnData )
         {
+            // Flag is cleared first, a write during the copy sets it again.
+            receivedData[handle.serviceIndex].testAndClear(handle.charIndex);
+
             uint8_t* charData = characteristic->getData();
 
             // Read all characteristic bytes if buffer is large enough, otherwise
@@ -318,7 +356,8 @@ int32_t Esp32Backend::readChar(uint8_t serviceIndex, uint8_t charIndex,
                 buff[readBytes] = charData[readBytes];
             }
 
-            receivedData[serviceIndex].rstFlag(charIndex);
+            // Size is reported even if it didn't all fit, as other backends do.
+            readBytes = characteristic->getLength();
         }
         else
         {
@@ -326,7 +365,7 @@ int32_t Esp32Backend::readChar(uint8_t serviceIndex, uint8_t charIndex,
 
             // If there is no new data to be read, make bytes available to
             // read negative.
-            if( !receivedData[serviceIndex].getFlag(charIndex) )
+            if( !receivedData[handle.serviceIndex].getFlag(handle.charIndex) )
             {
                 readBytes *= -1;
             }
@@ -339,19 +378,34 @@ int32_t Esp32Backend::readChar(uint8_t serviceIndex, uint8_t charIndex,
 bool Esp32Backend::writeChar(uint8_t serviceIndex, uint8_t charIndex,
                              const uint8_t *data, uint32_t dataSize)
 {
-    bool retval = false;
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
 
-    BLECharacteristic* characteristic = getCharacteristic(serviceIndex, charIndex);
+    return writeChar(handle, data, dataSize);
+}
 
-    // Data just gets coppied so it is safe to cast it from const here.
-    characteristic->setValue((uint8_t*)data, dataSize);
+bool Esp32Backend::writeChar(const CharHandle &handle,
+                             const uint8_t *data, uint32_t dataSize)
+{
+    bool retval = false;
 
-    readData[serviceIndex].rstFlag(charIndex);
+    BLECharacteristic* characteristic = handle.characteristic;
 
-    // Check if notify descriptor present and if it is send a notification.
-    if( characteristic->getDescriptorByUUID(notifyDescUuid) )
+    if( characteristic )
     {
-        characteristic->notify();
+        // Cleared before the new value is set, so a client read of it is kept.
+        readData[handle.serviceIndex].rstFlag(handle.charIndex);
+
+        // Data just gets coppied so it is safe to cast it from const here.
+        characteristic->setValue((uint8_t*)data, dataSize);
+
+        // Send a notification if notify descriptor is present.
+        if( handle.notify )
+        {
+            characteristic->notify();
+        }
+
+        retval = true;
     }
 
     return retval;
@@ -364,38 +418,236 @@ bool Esp32Backend::waitCharUpdate(uint8_t* serviceIndex, uint8_t* charIndex,
 
     *dataSize = 0;
 
-    Timeout waitCharUpdate(timeout);
+    Timeout waitCharUpdate(ifc->millis, timeout);
 
-    while( waitCharUpdate.notExpired() )
+    while( true )
     {
-        for( *serviceIndex = 0; *serviceIndex < servNum; (*serviceIndex)++ )
+        CharUpdate update;
+
+        if( popCharUpdate(&update) )
         {
-            const uint8_t serviceNumberOfChars = services[*serviceIndex].charNum;
-            for( *charIndex = 0; *charIndex < serviceNumberOfChars; (*charIndex)++ )
-            {
-                if( receivedData[*serviceIndex].getFlag(*charIndex) )
-                {
-                    BLECharacteristic* characteristic = getCharacteristic(*serviceIndex, *charIndex);
-                    *dataSize = characteristic->getLength();
-                    retval = true;
-                    break;
-                }
-            }
-            if( retval )
-            {
-                break;
-            }
+            *serviceIndex = update.serviceIndex;
+            *charIndex = update.charIndex;
+            *dataSize = update.dataSize;
+            retval = true;
+            break;
         }
-        if( retval )
+
+        int32_t remaining = waitCharUpdate.remaining();
+
+        if( remaining <= 0 )
         {
             break;
         }
-        ifc->delayMs(2);
+
+        if( idleHandler )
+        {
+            idleHandler(idleContext);
+
+            remaining = remaining < IDLE_PERIOD_MS ? remaining : IDLE_PERIOD_MS;
+        }
+
+        // Update is queued before semaphore is given, so an update that
+        // comes after the check above always wakes us up.
+        if( updateSem )
+        {
+            xSemaphoreTake(updateSem, pdMS_TO_TICKS(remaining));
+        }
+        else
+        {
+            ifc->delayMs(2);
+        }
     }
 
     return retval;
 }
 
+bool Esp32Backend::pushCharUpdate(uint8_t serviceIndex, uint8_t charIndex, uint32_t dataSize)
+{
+    uint8_t wr = charUpdatesWr.load(std::memory_order_relaxed);
+    uint8_t rd = charUpdatesRd.load(std::memory_order_acquire);
+
+    if( (uint8_t)(wr - rd) >= SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN )
+    {
+        charUpdatesLost.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    CharUpdate &update = charUpdates[wr % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+    update.serviceIndex = serviceIndex;
+    update.charIndex = charIndex;
+    update.dataSize = dataSize;
+
+    // Update is complete before consumer can see it.
+    charUpdatesWr.store(wr + 1, std::memory_order_release);
+
+    if( updateSem )
+    {
+        xSemaphoreGive(updateSem);
+    }
+
+    return true;
+}
+
+bool Esp32Backend::popCharUpdate(CharUpdate *update)
+{
+    uint8_t rd = charUpdatesRd.load(std::memory_order_relaxed);
+
+    if( rd == charUpdatesWr.load(std::memory_order_acquire) )
+    {
+        return false;
+    }
+
+    *update = charUpdates[rd % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+
+    // Slot is copied out before producer can reuse it.
+    charUpdatesRd.store(rd + 1, std::memory_order_release);
+
+    return true;
+}
+
+bool Esp32Backend::findPendingChar(uint8_t* serviceIndex, uint8_t* charIndex)
+{
+    for(uint8_t serv = *serviceIndex; serv < servNum; serv++)
+    {
+        int16_t pending = receivedData[serv].findFlag();
+
+        if( pending >= 0 )
+        {
+            *serviceIndex = serv;
+            *charIndex = pending;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Esp32Backend::addCharFifo(uint8_t serviceIndex, uint8_t charIndex, uint16_t maxSize,
+                               uint8_t depth, CharFifoPolicy policy)
+{
+    uint32_t fifoSize = (uint32_t)depth*(2 + maxSize);
+
+    // Callbacks look queues up without the lock, so they are only added
+    // before services start.
+    if( !getCharacteristic(serviceIndex, charIndex) ||
+        services[serviceIndex].fifoIds[charIndex] ||
+        servicesStarted || !charFifoLock || depth == 0 ||
+        charFifoNum >= SIMPLEBLE_CHAR_FIFO_MAX ||
+        fifoSize > SIMPLEBLE_CHAR_FIFO_POOL_B - charFifoPoolUsed )
+    {
+        return false;
+    }
+
+    // Characteristics are never removed, so queues are only bumped off the pool.
+    CharFifo &fifo = charFifos[charFifoNum];
+    fifo.slots = &charFifoPool[charFifoPoolUsed];
+    fifo.maxSize = maxSize;
+    fifo.depth = depth;
+    fifo.first = 0;
+    fifo.count = 0;
+    fifo.policy = policy;
+    fifo.overflows = 0;
+    charFifoPoolUsed += fifoSize;
+    charFifoNum++;
+    services[serviceIndex].fifoIds[charIndex] = charFifoNum;
+
+    return true;
+}
+
+bool Esp32Backend::pushCharFifo(uint8_t serviceIndex, uint8_t charIndex,
+                                const uint8_t *data, uint32_t dataSize)
+{
+    CharFifo *fifo = charFifo(serviceIndex, charIndex);
+
+    if( !fifo )
+    {
+        return false;
+    }
+
+    bool queued = false;
+
+    xSemaphoreTake(charFifoLock, portMAX_DELAY);
+
+do{
+    // Value that can't be queued leaves queued ones alone.
+    if( dataSize > fifo->maxSize )
+    {
+        fifo->overflows++;
+        break;
+    }
+
+    if( fifo->policy == FIFO_BACKPRESSURE )
+    {
+        Timeout blockTimeout(ifc->millis, SIMPLEBLE_CHAR_FIFO_BLOCK_MS);
+        int32_t remaining;
+
+        // Other queues may give the space semaphore too, so room is checked
+        // after every wake up.
+        while( fifo->count >= fifo->depth &&
+               (remaining = blockTimeout.remaining()) > 0 )
+        {
+            xSemaphoreGive(charFifoLock);
+            xSemaphoreTake(charFifoSpace, pdMS_TO_TICKS(remaining));
+            xSemaphoreTake(charFifoLock, portMAX_DELAY);
+        }
+    }
+
+    if( fifo->count >= fifo->depth && fifo->policy == FIFO_DROP_OLDEST )
+    {
+        fifo->first = (fifo->first + 1) % fifo->depth;
+        fifo->count--;
+        fifo->overflows++;
+    }
+
+    if( fifo->count >= fifo->depth )
+    {
+        fifo->overflows++;
+        break;
+    }
+
+    uint8_t *slot = fifoSlot(fifo, (fifo->first + fifo->count) % fifo->depth);
+    slot[0] = (uint8_t)dataSize;
+    slot[1] = (uint8_t)(dataSize >> 8);
+    memcpy(&slot[2], data, dataSize);
+    fifo->count++;
+
+    // Set under the lock, so it is never set for an empty queue.
+    receivedData[serviceIndex].setFlag(charIndex);
+    queued = true;
+}while(0);
+
+    xSemaphoreGive(charFifoLock);
+
+    if( queued )
+    {
+        pushCharUpdate(serviceIndex, charIndex, dataSize);
+    }
+
+    return true;
+}
+
+uint32_t Esp32Backend::charFifoOverflows(uint8_t serviceIndex, uint8_t charIndex)
+{
+    CharFifo *fifo = charFifo(serviceIndex, charIndex);
+    uint32_t overflows = 0;
+
+    if( fifo )
+    {
+        xSemaphoreTake(charFifoLock, portMAX_DELAY);
+        overflows = fifo->overflows;
+        xSemaphoreGive(charFifoLock);
+    }
+
+    return overflows;
+}
+
+void Esp32Backend::setIdleHandler(IdleHandler *handler, void *context)
+{
+    idleHandler = handler;
+    idleContext = context;
+}
+
 
 void Esp32Backend::debugPrint(const char *str)
 {
@@ -413,10 +665,61 @@ BLEUUID Esp32Backend::charUuidFromIndex(BLEUUID servUuid, uint8_t charIndex)
     return servUuid;
 }
 
+Esp32Backend::CharFifo *Esp32Backend::charFifo(uint8_t serviceIndex, uint8_t charIndex)
+{
+    uint8_t fifoId = serviceIndex < servNum && charIndex < services[serviceIndex].charNum ?
+                     services[serviceIndex].fifoIds[charIndex] :
+                     0;
+
+    return fifoId ? &charFifos[fifoId - 1] : NULL;
+}
+
+int32_t Esp32Backend::readCharFifo(const CharHandle &handle, CharFifo *fifo,
+                                   uint8_t *buff, uint32_t buffSize)
+{
+    int32_t readBytes = -1;
+
+    xSemaphoreTake(charFifoLock, portMAX_DELAY);
+
+    if( fifo->count )
+    {
+        uint8_t *slot = fifoSlot(fifo, fifo->first);
+        readBytes = slot[0] | (uint16_t)slot[1] << 8;
+
+        if( buff )
+        {
+            memcpy(buff, &slot[2], (uint32_t)readBytes < buffSize ? (uint32_t)readBytes : buffSize);
+
+            fifo->first = (fifo->first + 1) % fifo->depth;
+            fifo->count--;
+
+            if( !fifo->count )
+            {
+                receivedData[handle.serviceIndex].rstFlag(handle.charIndex);
+            }
+        }
+    }
+    else if( !buff )
+    {
+        // Nothing new, as for a characteristic without FIFO.
+        readBytes = -(int32_t)handle.characteristic->getLength();
+    }
+
+    xSemaphoreGive(charFifoLock);
+
+    if( buff && readBytes >= 0 && fifo->policy == FIFO_BACKPRESSURE )
+    {
+        xSemaphoreGive(charFifoSpace);
+    }
+
+    return readBytes;
+}
+
 BLECharacteristic* Esp32Backend::getCharacteristic(uint8_t servIndex, uint8_t charIndex)
 {
-    BLEService* service = services[servIndex].serv;
-    return service->getCharacteristic(charUuidFromIndex(servIndex, charIndex));
+    return servIndex < servNum && charIndex < services[servIndex].charNum ?
+           services[servIndex].chars[charIndex] :
+           NULL;
 }
 
 #endif //ESP32
@@ -6,9 +6,46 @@
 #include <BLEUtils.h>
 #include <BLE2902.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
 #include <stdint.h>
 
 
+// Number of characteristic updates that can wait for waitCharUpdate. Power of
+// two, up to 128.
+#ifndef SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN
+#define SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN     (16)
+#endif //SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN
+
+// GATT table capacity. Each service reserves room for its characteristic
+// pointers and flags, so raise these only as far as needed.
+#ifndef SIMPLEBLE_ESP32_MAX_SERVICES
+#define SIMPLEBLE_ESP32_MAX_SERVICES        (15)
+#endif //SIMPLEBLE_ESP32_MAX_SERVICES
+
+#ifndef SIMPLEBLE_ESP32_MAX_CHARS
+#define SIMPLEBLE_ESP32_MAX_CHARS           (10)
+#endif //SIMPLEBLE_ESP32_MAX_CHARS
+
+// Characteristics that can queue client writes, see addCharFifo, and bytes
+// shared by their queues.
+#ifndef SIMPLEBLE_CHAR_FIFO_MAX
+#define SIMPLEBLE_CHAR_FIFO_MAX             (4)
+#endif //SIMPLEBLE_CHAR_FIFO_MAX
+
+#ifndef SIMPLEBLE_CHAR_FIFO_POOL_B
+#define SIMPLEBLE_CHAR_FIFO_POOL_B          (256)
+#endif //SIMPLEBLE_CHAR_FIFO_POOL_B
+
+// Longest time a write to a full FIFO_BACKPRESSURE queue holds the BLE task
+// before it is dropped.
+#ifndef SIMPLEBLE_CHAR_FIFO_BLOCK_MS
+#define SIMPLEBLE_CHAR_FIFO_BLOCK_MS        (500)
+#endif //SIMPLEBLE_CHAR_FIFO_BLOCK_MS
+
+
 #define CONST_CEIL(div1, div2)      (((div1) +                                  \
                                       !!((div1)%(div2))*(div2) -                \
                                       (div1)%(div2)                             \
@@ -28,6 +65,9 @@
  * @param debugPrint Optional Function pointer to a function that prints
  *                   various debug information to desired output.
  */
+typedef void (IdleHandler)(void*);
+
+
 struct Esp32BackendInterface
 {
     uint32_t (*const millis)(void);
@@ -42,8 +82,38 @@ class Esp32Backend
 public:
     static const int8_t INVALID_SERVICE_INDEX = -1;
 
-    static const uint8_t MAX_NUM_SERVICES = 15;
-    static const uint8_t MAX_NUM_CHARS = 10;
+    static const uint8_t MAX_NUM_SERVICES = SIMPLEBLE_ESP32_MAX_SERVICES;
+    static const uint8_t MAX_NUM_CHARS = SIMPLEBLE_ESP32_MAX_CHARS;
+
+    // Indexes are returned as int8_t.
+    static_assert(MAX_NUM_SERVICES <= 127, "SIMPLEBLE_ESP32_MAX_SERVICES must be up to 127");
+    static_assert(MAX_NUM_CHARS <= 127, "SIMPLEBLE_ESP32_MAX_CHARS must be up to 127");
+
+    /**
+     * @brief What a characteristic FIFO does with a write when it is full.
+     */
+    enum CharFifoPolicy
+    {
+        // Oldest queued value makes room for the new one.
+        FIFO_DROP_OLDEST,
+        // New value is not queued.
+        FIFO_DROP_NEWEST,
+        // BLE task waits for room, so client writes are held back, up to
+        // SIMPLEBLE_CHAR_FIFO_BLOCK_MS , then new value is not queued.
+        FIFO_BACKPRESSURE
+    };
+
+    /**
+     * @brief Characteristic address with its BLE object looked up in advance,
+     *        see @ref makeCharHandle .
+     */
+    struct CharHandle
+    {
+        uint8_t serviceIndex;
+        uint8_t charIndex;
+        bool notify;
+        BLECharacteristic *characteristic;
+    };
 
     enum AdvType
     {
@@ -208,10 +278,13 @@ public:
      *        services are like folders.
      * 
      * @param servUuid Unique service ID.
+     * @param numChars Number of characteristics that will be added to the
+     *                 service, up to MAX_NUM_CHARS. Service handles are
+     *                 reserved for that many, so more can't be added later.
      * @return int8_t If successful returns positive service index, if an error
      *                occured returns negative number.
      */
-    int8_t addService(uint8_t servUuid);
+    int8_t addService(uint8_t servUuid, uint8_t numChars=MAX_NUM_CHARS);
 
     /**
      * @brief Add new characteristic to Simple BLE module under desired service.
@@ -229,6 +302,8 @@ public:
      */
     int8_t addChar(uint8_t serviceIndex, uint32_t maxSize, CharPropFlags flags);
 
+    bool makeCharHandle(uint8_t serviceIndex, uint8_t charIndex, CharHandle *handle);
+
     /**
      * @brief Check if characteristic has any new unread data.
      * 
@@ -246,11 +321,17 @@ public:
      * @param charIndex Desired characteristic index.
      * @param buff Buffer in which to save characteristic data.
      * @param buffSize Buffer size.
-     * @return int32_t Positive number if characteristic has some new data to read.
-     *                 Negative if characteristic has no new data to read.
+     * @return int32_t With buffer, size of characteristic data, even if only
+     *                 buffSize bytes were stored. Without buffer, positive
+     *                 number if characteristic has some new data to read,
+     *                 negative if it has no new data to read. With a FIFO,
+     *                 see @ref addCharFifo , values come from the queue,
+     *                 oldest first. Without buffer size of the oldest value
+     *                 is returned, with buffer -1 if nothing is queued.
      */
     int32_t readChar(uint8_t serviceIndex, uint8_t charIndex,
                       uint8_t *buff, uint32_t buffSize);
+    int32_t readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize);
 
     /**
      * @brief Write data to a characteristic.
@@ -264,24 +345,126 @@ public:
      */
     bool writeChar(uint8_t serviceIndex, uint8_t charIndex,
                    const uint8_t *data, uint32_t dataSize);
+    bool writeChar(const CharHandle &handle, const uint8_t *data, uint32_t dataSize);
 
+    /**
+     * @brief Get the oldest characteristic update written by the client.
+     *        Updates are queued by BLE callbacks in the order they arrive,
+     *        each write is a separate update.
+     *
+     * @param serviceIndex Service of the updated characteristic.
+     * @param charIndex Index of the updated characteristic.
+     * @param dataSize Size of the characteristic data after the write.
+     * @param timeout Time in milliseconds to wait if no update is queued.
+     * @return true If an update was received.
+     * @return false If there was no update before timeout.
+     */
     bool waitCharUpdate(uint8_t* serviceIndex, uint8_t* charIndex,
                         uint32_t* dataSize, uint32_t timeout=1000);
 
+    /**
+     * @brief Queue an update for @ref waitCharUpdate and wake it up. Called
+     *        from BLE callbacks, which are the only producer.
+     *
+     * @return true If update was queued.
+     * @return false If queue was full and update was dropped.
+     */
+    bool pushCharUpdate(uint8_t serviceIndex, uint8_t charIndex, uint32_t dataSize);
+
+    /**
+     * @brief Check whether characteristic was written by the client and not
+     *        read yet. It doesn't block.
+     */
+    inline bool charUpdatePending(uint8_t serviceIndex, uint8_t charIndex)
+    {
+        return serviceIndex < servNum && receivedData[serviceIndex].getFlag(charIndex);
+    }
+
+    /**
+     * @brief Number of characteristic updates dropped because update queue was
+     *        full, see SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN .
+     */
+    inline uint32_t lostCharUpdates(void) { return charUpdatesLost.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Find the first characteristic, starting at given service, that was
+     *        written by the client and not read yet. Use it to catch up on
+     *        updates after @ref lostCharUpdates grew. It doesn't block.
+     *
+     * @param serviceIndex Service to start from, set to service of the found
+     *                     characteristic.
+     * @param charIndex Set to index of the found characteristic.
+     * @return true If a characteristic with unread data was found.
+     * @return false If there are no unread characteristics.
+     */
+    bool findPendingChar(uint8_t* serviceIndex, uint8_t* charIndex);
+
+    /**
+     * @brief Queue every client write of a characteristic, instead of keeping
+     *        only the latest value. @ref readChar then returns queued values
+     *        one by one, oldest first. Queue is taken from
+     *        SIMPLEBLE_CHAR_FIFO_POOL_B . Add queues before advertisement
+     *        starts.
+     *
+     * @param serviceIndex Service of the characteristic.
+     * @param charIndex Index of the characteristic.
+     * @param maxSize Largest value that is queued, larger writes are dropped.
+     * @param depth Number of values the queue holds.
+     * @param policy What to do with a write when queue is full.
+     * @return true If queue was added.
+     * @return false If characteristic doesn't exist, already has a queue,
+     *               services already started, or there is no room for another
+     *               queue.
+     */
+    bool addCharFifo(uint8_t serviceIndex, uint8_t charIndex, uint16_t maxSize,
+                     uint8_t depth, CharFifoPolicy policy);
+
+    /**
+     * @brief Queue a client write in characteristic FIFO, then mark it as
+     *        received and queue its update. Called from BLE callbacks.
+     *
+     * @return true If characteristic has a FIFO. Write is queued, or counted
+     *              in @ref charFifoOverflows if it was dropped.
+     * @return false If characteristic has no FIFO and nothing was done.
+     */
+    bool pushCharFifo(uint8_t serviceIndex, uint8_t charIndex,
+                      const uint8_t *data, uint32_t dataSize);
+
+    /**
+     * @brief Number of client writes that characteristic FIFO dropped.
+     */
+    uint32_t charFifoOverflows(uint8_t serviceIndex, uint8_t charIndex);
+
+    /**
+     * @brief Set handler which is called while @ref waitCharUpdate waits.
+     *
+     * @param handler Handler function or NULL.
+     * @param context Context pointer passed to handler.
+     */
+    void setIdleHandler(IdleHandler *handler, void *context);
+
     const Esp32BackendInterface *ifc;
 
     bool restartAdvOnDisc;
 
-    struct
-    {
-        BLEService* serv;
-        uint8_t charNum;
-    } services[MAX_NUM_SERVICES];
-    uint8_t servNum;
-
+    /**
+     * @brief One flag per characteristic of a service, in 32 bit words so set
+     *        flags are found a word at a time. BLE callbacks set flags while
+     *        the application task checks and clears them, so words are atomic
+     *        and each change is a single read-modify-write that doesn't touch
+     *        other flags of the word.
+     */
     struct UpdatedDataFlags
     {
-        UpdatedDataFlags() { memset(charFlags, 0x00, sizeof(charFlags)); }
+        UpdatedDataFlags() { clear(); }
+
+        inline void clear(void)
+        {
+            for(uint8_t word = 0; word < sizeof(charFlags)/sizeof(charFlags[0]); word++)
+            {
+                charFlags[word].store(0, std::memory_order_relaxed);
+            }
+        }
 
         inline bool isValidIndex(uint32_t charIndex)
         {
@@ -291,7 +474,9 @@ public:
         {
             if( isValidIndex(charIndex) )
             {
-                charFlags[charIndex/bitsPerByte] |= 1 << (charIndex%bitsPerByte);
+                // Release, so data written before the flag is seen with it.
+                charFlags[charIndex/bitsPerWord].fetch_or(flagBit(charIndex),
+                                                          std::memory_order_release);
             }
 
             return isValidIndex(charIndex);
@@ -300,7 +485,8 @@ public:
         {
             if( isValidIndex(charIndex) )
             {
-                charFlags[charIndex/bitsPerByte] &= ~(1 << (charIndex%bitsPerByte));
+                charFlags[charIndex/bitsPerWord].fetch_and(~flagBit(charIndex),
+                                                           std::memory_order_relaxed);
             }
 
             return isValidIndex(charIndex);
@@ -309,7 +495,8 @@ public:
         {
             if( isValidIndex(charIndex) )
             {
-                return charFlags[charIndex/bitsPerByte] & 1 << (charIndex%bitsPerByte);
+                return charFlags[charIndex/bitsPerWord].load(std::memory_order_acquire) &
+                       flagBit(charIndex);
             }
             else
             {
@@ -317,11 +504,68 @@ public:
             }
         }
 
-        static const int bitsPerByte = 8;
+        /**
+         * @brief Clear the flag and return whether it was set. Consume data
+         *        after this, so a write that lands meanwhile sets the flag
+         *        again instead of being lost.
+         */
+        inline bool testAndClear(uint32_t charIndex)
+        {
+            if( isValidIndex(charIndex) )
+            {
+                return charFlags[charIndex/bitsPerWord].fetch_and(~flagBit(charIndex),
+                                                                  std::memory_order_acq_rel) &
+                       flagBit(charIndex);
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        /**
+         * @brief Index of the first set flag, or -1 if none is set.
+         */
+        inline int16_t findFlag(void)
+        {
+            for(uint8_t word = 0; word < sizeof(charFlags)/sizeof(charFlags[0]); word++)
+            {
+                uint32_t flags = charFlags[word].load(std::memory_order_acquire);
+
+                if( flags )
+                {
+                    return word*bitsPerWord + __builtin_ctz(flags);
+                }
+            }
+
+            return -1;
+        }
+
+        static const int bitsPerWord = 32;
+
+        static inline uint32_t flagBit(uint32_t charIndex)
+        {
+            return (uint32_t)1 << (charIndex%bitsPerWord);
+        }
 
-        uint8_t charFlags[CONST_CEIL(MAX_NUM_CHARS, bitsPerByte)];
+        std::atomic<uint32_t> charFlags[CONST_CEIL(MAX_NUM_CHARS, bitsPerWord)];
     };
 
+    struct
+    {
+        BLEService* serv;
+        uint8_t charNum;
+        uint8_t maxChars;
+        // Filled in addChar, so characteristics are found by index.
+        BLECharacteristic* chars[MAX_NUM_CHARS];
+        UpdatedDataFlags notifyChars;
+        // Index in charFifos plus one, 0 if characteristic has no FIFO.
+        uint8_t fifoIds[MAX_NUM_CHARS];
+    } services[MAX_NUM_SERVICES];
+
+    uint8_t servNum;
+    bool servicesStarted;
+
     UpdatedDataFlags receivedData[sizeof(services)/sizeof(services[0])];
     UpdatedDataFlags readData[sizeof(services)/sizeof(services[0])];
 
@@ -329,6 +573,69 @@ private:
 
     BLEServer* pServer;
 
+    static_assert(SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN <= 128 &&
+                  !(SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN & (SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN - 1)),
+                  "SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN must be a power of two up to 128");
+
+    /**
+     * @brief Characteristic update received in onWrite callback.
+     */
+    struct CharUpdate
+    {
+        uint8_t serviceIndex;
+        uint8_t charIndex;
+        uint32_t dataSize;
+    };
+
+    // Single producer, single consumer ring: BLE callbacks only advance the
+    // write index and waitCharUpdate only the read one. Indexes run freely
+    // and wrap at 256.
+    CharUpdate charUpdates[SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+    std::atomic<uint8_t> charUpdatesWr;
+    std::atomic<uint8_t> charUpdatesRd;
+    std::atomic<uint32_t> charUpdatesLost;
+
+    // Given on each characteristic write, so waiting task sleeps until then.
+    SemaphoreHandle_t updateSem;
+
+    bool popCharUpdate(CharUpdate *update);
+
+    /**
+     * @brief Queue of client writes of one characteristic. Each slot holds
+     *        value size in two bytes, then value.
+     */
+    struct CharFifo
+    {
+        uint8_t *slots;
+        uint16_t maxSize;
+        uint8_t depth;
+        uint8_t first;
+        uint8_t count;
+        CharFifoPolicy policy;
+        uint32_t overflows;
+    };
+
+    CharFifo charFifos[SIMPLEBLE_CHAR_FIFO_MAX];
+    uint8_t charFifoNum;
+    uint8_t charFifoPool[SIMPLEBLE_CHAR_FIFO_POOL_B];
+    uint32_t charFifoPoolUsed;
+
+    // BLE task and application task both change queues under this lock. BLE
+    // task waits on charFifoSpace for a FIFO_BACKPRESSURE queue to drain.
+    SemaphoreHandle_t charFifoLock;
+    SemaphoreHandle_t charFifoSpace;
+
+    CharFifo *charFifo(uint8_t serviceIndex, uint8_t charIndex);
+    inline uint8_t *fifoSlot(CharFifo *fifo, uint8_t slot)
+    {
+        return &fifo->slots[(uint32_t)slot*(2 + fifo->maxSize)];
+    }
+    int32_t readCharFifo(const CharHandle &handle, CharFifo *fifo,
+                         uint8_t *buff, uint32_t buffSize);
+
+    IdleHandler *idleHandler;
+    void *idleContext;
+
     inline void internalDebug(const char *dbgPrint)
     {
         if( ifc->debugPrint )
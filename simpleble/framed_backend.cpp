@@ -0,0 +1,315 @@
+#include "framed_backend.h"
+#include "at_process.h"
+#include "timeout.h"
+
+#include <string.h>
+
+
+// Sync byte, body length, type and sequence.
+#define FRAME_HEAD_B                                            (5)
+#define FRAME_CRC_B                                             (2)
+// Type, sequence and CRC of a body without fields.
+#define FRAME_MIN_BODY_B                                        (4)
+#define FRAME_TIMEOUT_MS                                        (1000)
+
+
+FramedBackend::FramedBackend(const SimpleBLEBackendInterface *ifc) :
+    SimpleBLEBackend(ifc),
+    framesOn(false),
+    txSeq(0),
+    pendingSeq(0),
+    pendingStatus(AtProcess::SUCCESS),
+    readBuff(NULL),
+    readBuffSize(0),
+    readSize(0),
+    readNewData(false)
+{
+}
+
+bool FramedBackend::enableFrames(void)
+{
+    framesOn = false;
+
+    if( sendReceiveCmd("AT+FRAMES=1") != AtProcess::SUCCESS )
+    {
+        return false;
+    }
+
+    // Frames can only follow the OK, which is already processed.
+    at.setFrameHandler(FRAME_SYNC, FRAME_MAX_BODY_B, frameReceived, this);
+    framesOn = true;
+
+    return true;
+}
+
+bool FramedBackend::softRestart(void)
+{
+    framesOn = false;
+
+    bool retval = SimpleBLEBackend::softRestart();
+
+    if( retval )
+    {
+        enableFrames();
+    }
+
+    return retval;
+}
+
+void FramedBackend::hardResetModule(void)
+{
+    framesOn = false;
+
+    SimpleBLEBackend::hardResetModule();
+}
+
+int32_t FramedBackend::readChar(uint8_t serviceIndex, uint8_t charIndex,
+                                uint8_t *buff, uint32_t buffSize)
+{
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return readChar(handle, buff, buffSize);
+}
+
+int32_t FramedBackend::readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize)
+{
+    if( framesOn )
+    {
+        uint8_t fields[3] = { handle.serviceIndex, handle.charIndex, buff ? (uint8_t)1 : (uint8_t)0 };
+
+        readBuff = buff;
+        readBuffSize = buff ? buffSize : 0;
+
+        AtProcess::Status status = frameTransaction(FRAME_READ, fields, sizeof(fields), NULL, 0);
+
+        readBuff = NULL;
+
+        if( status == AtProcess::SUCCESS )
+        {
+            // Without data, size is negative if there is no new data, as
+            // with ^READCHAR.
+            return buff || readNewData ? (int32_t)readSize : -(int32_t)readSize;
+        }
+        else if( status != AtProcess::TIMEOUT )
+        {
+            // Module may have handled the read, so it isn't sent again.
+            // Errors are reported the same way as without frames.
+            return buff ? -1 : (int32_t)buffSize;
+        }
+
+        framesLost();
+    }
+
+    return SimpleBLEBackend::readChar(handle, buff, buffSize);
+}
+
+bool FramedBackend::writeChar(uint8_t serviceIndex, uint8_t charIndex,
+                              const uint8_t *data, uint32_t dataSize)
+{
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return writeChar(handle, data, dataSize);
+}
+
+bool FramedBackend::writeChar(const CharHandle &handle,
+                              const uint8_t *data, uint32_t dataSize)
+{
+    if( framesOn )
+    {
+        uint8_t fields[2] = { handle.serviceIndex, handle.charIndex };
+
+        AtProcess::Status status = frameTransaction(FRAME_WRITE, fields, sizeof(fields),
+                                                    data, dataSize);
+
+        if( status != AtProcess::TIMEOUT )
+        {
+            return status == AtProcess::SUCCESS;
+        }
+
+        framesLost();
+    }
+
+    return SimpleBLEBackend::writeChar(handle, data, dataSize);
+}
+
+uint16_t FramedBackend::crc16(uint16_t crc, const uint8_t *data, uint32_t dataLen)
+{
+    for(uint32_t i = 0; i < dataLen; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+
+        for(uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+
+AtProcess::Status FramedBackend::frameTransaction(uint8_t type,
+                                                  const uint8_t *fields, uint8_t fieldsLen,
+                                                  const uint8_t *data, uint32_t dataLen)
+{
+    // Frames bypass the command pipeline, so queued commands go first.
+    if( at.responsesInFlight() )
+    {
+        flushQueue(FRAME_TIMEOUT_MS);
+
+        // Frame isn't sent while an AT response is still on its way.
+        if( at.responsesInFlight() )
+        {
+            return AtProcess::TIMEOUT;
+        }
+    }
+
+    uint32_t bodyLen = 2 + fieldsLen + dataLen + FRAME_CRC_B;
+
+    if( bodyLen > FRAME_MAX_BODY_B || fieldsLen > 3 )
+    {
+        return AtProcess::GEN_ERROR;
+    }
+
+    // Sequence 0 is left for module events.
+    txSeq = txSeq == 0xFF ? 1 : txSeq + 1;
+
+    uint8_t head[FRAME_HEAD_B + 3] = {
+        FRAME_SYNC, (uint8_t)bodyLen, (uint8_t)(bodyLen >> 8), type, txSeq
+    };
+    memcpy(&head[FRAME_HEAD_B], fields, fieldsLen);
+
+    uint16_t crc = crc16(0xFFFF, &head[3], 2 + fieldsLen);
+    crc = crc16(crc, data, dataLen);
+    uint8_t tail[FRAME_CRC_B] = { (uint8_t)crc, (uint8_t)(crc >> 8) };
+
+    pendingSeq = txSeq;
+    pendingStatus = AtProcess::IN_PROGRESS;
+
+    uint32_t sent = at.write(head, FRAME_HEAD_B + fieldsLen);
+    if( dataLen )
+    {
+        sent += at.write(data, dataLen);
+    }
+    sent += at.write(tail, sizeof(tail));
+    fillRxBlock(sent);
+
+    Deadline frameDeadline(ifc->millis, FRAME_TIMEOUT_MS);
+
+    while( pendingStatus == AtProcess::IN_PROGRESS )
+    {
+        if( frameDeadline.expired() )
+        {
+            pendingStatus = AtProcess::TIMEOUT;
+            break;
+        }
+
+        if( !at.process() )
+        {
+            at.waitInput(frameDeadline.remaining());
+        }
+    }
+
+    return pendingStatus;
+}
+
+void FramedBackend::framesLost(void)
+{
+    // Module probably restarted on its own and is in AT mode again.
+    internalDebug("No frame response, using AT commands\r\n");
+
+    framesOn = false;
+    at.discardInput();
+}
+
+void FramedBackend::frameReceived(const uint8_t *chunk, uint16_t chunkLen,
+                                  uint16_t offset, uint16_t bodyLen, void *context)
+{
+    FramedBackend *owner = (FramedBackend*)context;
+
+    for(uint16_t i = 0; i < chunkLen; i++)
+    {
+        owner->frameByte(chunk[i], offset + i, bodyLen);
+    }
+}
+
+void FramedBackend::frameByte(uint8_t c, uint16_t pos, uint16_t bodyLen)
+{
+    uint16_t crcPos = bodyLen < FRAME_CRC_B ? 0 : bodyLen - FRAME_CRC_B;
+
+    if( pos == 0 )
+    {
+        rxCrc = 0xFFFF;
+        memset(rxHead, 0, sizeof(rxHead));
+    }
+
+    if( pos < crcPos )
+    {
+        rxCrc = crc16(rxCrc, &c, 1);
+
+        if( pos < sizeof(rxHead) )
+        {
+            rxHead[pos] = c;
+        }
+        else if( rxHead[0] == FRAME_READ_RESP && rxHead[1] == pendingSeq &&
+                 pendingStatus == AtProcess::IN_PROGRESS &&
+                 readBuff && pos - sizeof(rxHead) < readBuffSize )
+        {
+            readBuff[pos - sizeof(rxHead)] = c;
+        }
+    }
+    else if( pos == crcPos )
+    {
+        rxCrcReceived = c;
+    }
+    else
+    {
+        rxCrcReceived |= (uint16_t)c << 8;
+        frameComplete(bodyLen);
+    }
+}
+
+void FramedBackend::frameComplete(uint16_t bodyLen)
+{
+    if( bodyLen < FRAME_MIN_BODY_B || rxCrc != rxCrcReceived )
+    {
+        internalDebug("Malformed frame\r\n");
+        return;
+    }
+
+    uint16_t fieldsLen = bodyLen - FRAME_MIN_BODY_B;
+    bool answer = rxHead[1] == pendingSeq && pendingStatus == AtProcess::IN_PROGRESS;
+    AtProcess::Status status = rxHead[2] == FRAME_OK ? AtProcess::SUCCESS : AtProcess::GEN_ERROR;
+
+    switch( rxHead[0] )
+    {
+        case FRAME_WRITE_ACK:
+            if( answer && fieldsLen >= 1 )
+            {
+                pendingStatus = status;
+            }
+            break;
+
+        case FRAME_READ_RESP:
+            if( answer && fieldsLen >= 4 )
+            {
+                readNewData = rxHead[3];
+                readSize = rxHead[4] | (uint16_t)rxHead[5] << 8;
+                pendingStatus = status;
+            }
+            break;
+
+        case FRAME_CHARWRITE:
+            if( fieldsLen >= 4 )
+            {
+                queueCharUpdate(rxHead[2], rxHead[3], rxHead[4] | (uint16_t)rxHead[5] << 8);
+            }
+            break;
+
+        default:
+            internalDebug("Unknown frame\r\n");
+            break;
+    }
+}
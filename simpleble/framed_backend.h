@@ -0,0 +1,143 @@
+#ifndef __FRAMED_BACKEND_H__
+#define __FRAMED_BACKEND_H__
+
+#include "simple_ble_backend.h"
+
+#include <stdint.h>
+
+
+// Largest characteristic that can be read in one frame.
+#ifndef FRAMED_MAX_CHAR_SIZE_B
+#define FRAMED_MAX_CHAR_SIZE_B              (512)
+#endif //FRAMED_MAX_CHAR_SIZE_B
+
+#define FRAME_SYNC                          (0xA5)
+// Type, sequence, read response fields, data and CRC.
+#define FRAME_MAX_BODY_B                    (2 + 4 + FRAMED_MAX_CHAR_SIZE_B + 2)
+
+
+/**
+ * @brief Backend that moves characteristic traffic to binary frames, so it
+ *        doesn't pay for ASCII numbers, command echo and OK line. Frames are
+ *        enabled from AT mode with AT+FRAMES=1, and AT commands keep working
+ *        next to them. If module doesn't support frames, or stops answering
+ *        them, backend works with AT commands as @ref SimpleBLEBackend does.
+ *
+ * Frame, in both directions:
+ *
+ *   <0xA5> <body length, 2 B> <type> <sequence> <fields> <CRC, 2 B>
+ *
+ * Multi byte values are little endian. CRC is CRC-16/CCITT-FALSE of type,
+ * sequence and fields. Module answers a host frame with the same sequence,
+ * its own events have sequence 0.
+ *
+ *   WRITE      0x01  host    service, char, data
+ *   READ       0x02  host    service, char, return data
+ *   WRITE_ACK  0x81  module  status
+ *   READ_RESP  0x82  module  status, new data, size (2 B), data
+ *   CHARWRITE  0x83  module  service, char, size (2 B)
+ */
+class FramedBackend : public SimpleBLEBackend
+{
+public:
+
+    enum FrameType
+    {
+        FRAME_WRITE = 0x01,
+        FRAME_READ = 0x02,
+        FRAME_WRITE_ACK = 0x81,
+        FRAME_READ_RESP = 0x82,
+        FRAME_CHARWRITE = 0x83
+    };
+
+    enum FrameStatus
+    {
+        FRAME_OK = 0,
+        FRAME_ERROR = 1
+    };
+
+    /**
+     * @brief Construct a new Framed Backend object
+     *
+     * @param ifc Complete SimpleBLE interface, with all external dependancies.
+     */
+    FramedBackend(const SimpleBLEBackendInterface *ifc);
+
+    /**
+     * @brief Switch characteristic traffic to frames with AT+FRAMES=1.
+     *
+     * @return true If module accepted frames.
+     * @return false If module doesn't support frames, AT commands are used.
+     */
+    bool enableFrames(void);
+
+    /**
+     * @brief Check whether characteristic traffic goes through frames.
+     */
+    inline bool framesEnabled(void) { return framesOn; }
+
+    /**
+     * @brief Restart module like @ref SimpleBLEBackend::softRestart and enable
+     *        frames again, module always starts in AT mode.
+     */
+    bool softRestart(void);
+
+    /**
+     * @brief Reset module like @ref SimpleBLEBackend::hardResetModule . Frames
+     *        stay off until the next @ref softRestart or @ref enableFrames .
+     */
+    void hardResetModule(void);
+
+    /**
+     * @brief Same as @ref SimpleBLEBackend::readChar , but through a frame if
+     *        frames are enabled. Only if frame gets no answer, read is sent
+     *        again as AT command.
+     */
+    int32_t readChar(uint8_t serviceIndex, uint8_t charIndex,
+                     uint8_t *buff, uint32_t buffSize);
+    int32_t readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize);
+
+    /**
+     * @brief Same as @ref SimpleBLEBackend::writeChar , but through a frame if
+     *        frames are enabled. Only if frame gets no answer, write is sent
+     *        again as AT command.
+     */
+    bool writeChar(uint8_t serviceIndex, uint8_t charIndex,
+                   const uint8_t *data, uint32_t dataSize);
+    bool writeChar(const CharHandle &handle, const uint8_t *data, uint32_t dataSize);
+
+    /**
+     * @brief Update CRC-16/CCITT-FALSE with data. Start with 0xFFFF.
+     */
+    static uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t dataLen);
+
+private:
+    bool framesOn;
+    uint8_t txSeq;
+
+    // Answer to the frame in flight.
+    uint8_t pendingSeq;
+    AtProcess::Status pendingStatus;
+    uint8_t *readBuff;
+    uint32_t readBuffSize;
+    uint16_t readSize;
+    bool readNewData;
+
+    // Frame being received.
+    uint8_t rxHead[6];
+    uint16_t rxCrc;
+    uint16_t rxCrcReceived;
+
+    AtProcess::Status frameTransaction(uint8_t type,
+                                       const uint8_t *fields, uint8_t fieldsLen,
+                                       const uint8_t *data, uint32_t dataLen);
+    void framesLost(void);
+
+    static void frameReceived(const uint8_t *chunk, uint16_t chunkLen,
+                              uint16_t offset, uint16_t bodyLen, void *context);
+    void frameByte(uint8_t c, uint16_t pos, uint16_t bodyLen);
+    void frameComplete(uint16_t bodyLen);
+};
+
+
+#endif//__FRAMED_BACKEND_H__
@@ -33,12 +33,49 @@ static const SimpleBLEBackendInterface SimpleBLE::arduinoIf = {
     [](void) { return (uint32_t)millis(); },
     [](uint32_t ms) { delay(ms); },
     //[](const char *dbg) { Serial.print(dbg); }
-    NULL
+    NULL,
+    [](const uint8_t *data, uint32_t dataLen) { return (uint32_t)altSerial.write(data, dataLen); },
+    [](uint8_t *data, uint32_t dataLen)
+    {
+        int availableChars = altSerial.available();
+        uint32_t readLen = availableChars > 0 ? availableChars : 0;
+
+        readLen = readLen < dataLen ? readLen : dataLen;
+
+        for(uint32_t i = 0; i < readLen; i++)
+        {
+            data[i] = altSerial.read();
+        }
+
+        return readLen;
+    },
+    [](uint32_t ms)
+    {
+        // AltSoftSerial has no RX event to sleep on, but spinning on it returns
+        // as soon as the first byte arrives.
+        uint32_t start = millis();
+
+        while( altSerial.available() <= 0 && (uint32_t)millis() - start < ms );
+
+        return altSerial.available() > 0;
+    },
+    [](uint32_t baud)
+    {
+        if( baud > SIMPLEBLE_ALTSERIAL_MAX_BAUD )
+        {
+            return false;
+        }
+
+        altSerial.end();
+        altSerial.begin(baud);
+
+        return true;
+    }
 };
 #endif //USING_ESP32_BACKEND
 #endif //USING_ARDUINO_INTERFACE
 
-bool SimpleBLE::begin()
+bool SimpleBLE::begin(uint32_t targetBaud)
 {
     bool retval = false;
 
@@ -49,7 +86,7 @@ bool SimpleBLE::begin()
 
     arduinoIf.rxEnabledSet(true);
     arduinoIf.moduleResetSet(true);
-    altSerial.begin(9600);
+    altSerial.begin(SIMPLEBLE_DEFAULT_BAUD);
 #endif //USING_ESP32_BACKEND
 
     arduinoIf.delayMs(500);
@@ -59,8 +96,30 @@ bool SimpleBLE::begin()
 
     exitUltraLowPower();
 
+    bool restarted = softRestart();
+
+#ifndef USING_ESP32_BACKEND
+    // Module keeps negotiated speed if only the host was restarted, reset
+    // brings it back to default speed.
+    if( !restarted && targetBaud )
+    {
+        hardResetModule();
+        restarted = softRestart();
+    }
+
+    if( restarted )
+    {
+        backend.negotiateBaud(targetBaud);
+    }
+#else
+    (void)targetBaud;
+#endif //USING_ESP32_BACKEND
+
+    // Module forgot all tanks, and so do their buffers.
+    resetTankBuffers();
+
 do{
-    if( !softRestart() )
+    if( !restarted )
     {
         break;
     }
@@ -82,7 +141,8 @@ do{
     return retval;
 }
 
-SimpleBLE::TankId SimpleBLE::addTank(SimpleBLE::TankType type, uint32_t maxSizeBytes)
+SimpleBLE::TankId SimpleBLE::addTank(SimpleBLE::TankType type, uint32_t maxSizeBytes,
+                                     uint8_t options)
 {
     BackendNs::CharPropFlags charFlags = BackendNs::NONE;
 
@@ -112,6 +172,43 @@ SimpleBLE::TankId SimpleBLE::addTank(SimpleBLE::TankType type, uint32_t maxSizeB
             charFlags);
     }
 
+    // Tank address is formatted only once, reads and writes reuse it.
+    if( newTankId >= 0 && newTankId < SIMPLEBLE_MAX_TANKS &&
+        backend.makeCharHandle(tanksServiceIndex, newTankId, &tankHandles[newTankId]) )
+    {
+        tankHandlesValid |= (uint32_t)1 << newTankId;
+    }
+
+    // Without room for its buffer, tank works without the option.
+    if( (options & TANK_LATEST_VALUE) && type == SimpleBLE::READ &&
+        tankBit(newTankId) && allocTankBuffer(&tankStages[newTankId], maxSizeBytes) )
+    {
+        tankStaged |= tankBit(newTankId);
+    }
+
+    if( (options & TANK_SHADOW) &&
+        tankBit(newTankId) && allocTankBuffer(&tankShadows[newTankId], maxSizeBytes) )
+    {
+        tankShadowed |= tankBit(newTankId);
+    }
+
+#ifdef USING_ESP32_BACKEND
+    if( (options & TANK_FIFO) && type != SimpleBLE::READ && tankBit(newTankId) )
+    {
+        BackendNs::CharFifoPolicy policy =
+            (options & TANK_FIFO_BACKPRESSURE) ? BackendNs::FIFO_BACKPRESSURE :
+            (options & TANK_FIFO_DROP_NEWEST) ? BackendNs::FIFO_DROP_NEWEST :
+            BackendNs::FIFO_DROP_OLDEST;
+
+        if( maxSizeBytes <= 0xFFFF &&
+            backend.addCharFifo(tanksServiceIndex, newTankId, maxSizeBytes,
+                                SIMPLEBLE_TANK_FIFO_DEPTH, policy) )
+        {
+            tankFifos |= tankBit(newTankId);
+        }
+    }
+#endif //USING_ESP32_BACKEND
+
     return newTankId;
 }
 
@@ -157,6 +254,17 @@ bool SimpleBLE::waitUpdates(TankId* tank, uint32_t* updateSize, uint32_t timeout
     {
         *tank = charIndex;
 
+        // Update is no longer pending in the backend, so shadow has to go.
+        tankShadowValid &= ~tankBit(charIndex);
+
+        // Queue may have dropped values since the update, so size is taken
+        // from the value readTank returns next.
+        if( tankFifos & tankBit(charIndex) )
+        {
+            int32_t queuedSize = backend.readChar(tanksServiceIndex, charIndex, NULL, 0);
+            dataSize = queuedSize > 0 ? queuedSize : 0;
+        }
+
         if( updateSize ) *updateSize = dataSize;
     }
 
@@ -165,13 +273,33 @@ bool SimpleBLE::waitUpdates(TankId* tank, uint32_t* updateSize, uint32_t timeout
 
 bool SimpleBLE::readTank(TankId tank, uint8_t *buff, uint32_t buffSize, uint32_t* readLen)
 {
-    int32_t internalReadLen = backend.readChar(tanksServiceIndex, (uint8_t)tank, buff, buffSize);
+    int32_t internalReadLen;
 
-    bool retval = internalReadLen <= buffSize;
+    if( buff && shadowCurrent(tank) )
+    {
+        const TankBuffer &shadow = tankShadows[tank];
+
+        memcpy(buff, shadow.data, shadow.size < buffSize ? shadow.size : buffSize);
+        internalReadLen = shadow.size;
+    }
+    else
+    {
+        const BackendNs::CharHandle *handle = tankHandle(tank);
+        internalReadLen = handle ?
+            backend.readChar(*handle, buff, buffSize) :
+            backend.readChar(tanksServiceIndex, (uint8_t)tank, buff, buffSize);
+
+        if( buff && internalReadLen >= 0 && (uint32_t)internalReadLen <= buffSize )
+        {
+            setShadow(tank, buff, internalReadLen);
+        }
+    }
+
+    bool retval = internalReadLen >= 0 && (uint32_t)internalReadLen <= buffSize;
 
     if( readLen )
     {
-        *readLen = internalReadLen;
+        *readLen = internalReadLen >= 0 ? internalReadLen : 0;
     }
 
     return retval;
@@ -179,7 +307,24 @@ bool SimpleBLE::readTank(TankId tank, uint8_t *buff, uint32_t buffSize, uint32_t
 
 bool SimpleBLE::writeTank(TankId tank, const uint8_t *data, uint32_t dataSize)
 {
-    return backend.writeChar(tanksServiceIndex, (uint8_t)tank, data, dataSize);
+    if( tankStaged & tankBit(tank) )
+    {
+        TankBuffer &stage = tankStages[tank];
+
+        if( dataSize > stage.maxSize )
+        {
+            return false;
+        }
+
+        // Value that wasn't flushed yet is simply overwritten.
+        memcpy(stage.data, data, dataSize);
+        stage.size = dataSize;
+        tankDirty |= tankBit(tank);
+
+        return true;
+    }
+
+    return sendTank(tank, data, dataSize);
 }
 
 bool SimpleBLE::writeTank(TankId tank, const char *str)
@@ -187,6 +332,141 @@ bool SimpleBLE::writeTank(TankId tank, const char *str)
     return writeTank(tank, (const uint8_t*)str, strlen(str));
 }
 
+bool SimpleBLE::flushTanks(void)
+{
+    bool retval = true;
+
+    for(TankId tank = 0; tankDirty && tank < SIMPLEBLE_MAX_TANKS; tank++)
+    {
+        if( !(tankDirty & tankBit(tank)) )
+        {
+            continue;
+        }
+
+        if( sendTank(tank, tankStages[tank].data, tankStages[tank].size) )
+        {
+            tankDirty &= ~tankBit(tank);
+        }
+        else
+        {
+            retval = false;
+        }
+    }
+
+    return retval;
+}
+
+uint32_t SimpleBLE::tankOverflows(TankId tank)
+{
+#ifdef USING_ESP32_BACKEND
+    return tankFifos & tankBit(tank) ?
+           backend.charFifoOverflows(tanksServiceIndex, tank) :
+           0;
+#else
+    (void)tank;
+
+    return 0;
+#endif //USING_ESP32_BACKEND
+}
+
+void SimpleBLE::resetTankBuffers(void)
+{
+    tankPoolUsed = 0;
+    tankStaged = 0;
+    tankDirty = 0;
+    tankShadowed = 0;
+    tankShadowValid = 0;
+    shadowLostUpdates = backend.lostCharUpdates();
+    tankFifos = 0;
+}
+
+bool SimpleBLE::allocTankBuffer(TankBuffer *buffer, uint32_t maxSizeBytes)
+{
+    if( maxSizeBytes > (uint32_t)(SIMPLEBLE_TANK_POOL_B - tankPoolUsed) )
+    {
+        return false;
+    }
+
+    // Tanks are never removed, so buffers are only bumped off the pool.
+    buffer->data = &tankPool[tankPoolUsed];
+    buffer->maxSize = maxSizeBytes;
+    buffer->size = 0;
+    tankPoolUsed += maxSizeBytes;
+
+    return true;
+}
+
+bool SimpleBLE::shadowCurrent(TankId tank)
+{
+    if( !(tankShadowValid & tankBit(tank)) )
+    {
+        return false;
+    }
+
+    // Client writes are only known from updates.
+    if( backend.charUpdatePending(tanksServiceIndex, tank) )
+    {
+        tankShadowValid &= ~tankBit(tank);
+    }
+
+    // Dropped update could be for any tank.
+    if( backend.lostCharUpdates() != shadowLostUpdates )
+    {
+        shadowLostUpdates = backend.lostCharUpdates();
+        tankShadowValid = 0;
+    }
+
+    return tankShadowValid & tankBit(tank);
+}
+
+void SimpleBLE::setShadow(TankId tank, const uint8_t *data, uint32_t dataSize)
+{
+    if( !(tankShadowed & tankBit(tank)) )
+    {
+        return;
+    }
+
+    TankBuffer &shadow = tankShadows[tank];
+
+    if( dataSize > shadow.maxSize )
+    {
+        tankShadowValid &= ~tankBit(tank);
+        return;
+    }
+
+    memcpy(shadow.data, data, dataSize);
+    shadow.size = dataSize;
+    tankShadowValid |= tankBit(tank);
+}
+
+bool SimpleBLE::sendTank(TankId tank, const uint8_t *data, uint32_t dataSize)
+{
+    // Module already holds this value.
+    if( shadowCurrent(tank) && tankShadows[tank].size == dataSize &&
+        !memcmp(tankShadows[tank].data, data, dataSize) )
+    {
+        return true;
+    }
+
+    const BackendNs::CharHandle *handle = tankHandle(tank);
+
+    bool retval = handle ?
+        backend.writeChar(*handle, data, dataSize) :
+        backend.writeChar(tanksServiceIndex, (uint8_t)tank, data, dataSize);
+
+    if( retval )
+    {
+        setShadow(tank, data, dataSize);
+    }
+    else
+    {
+        // Module may hold the old value, the new one or neither.
+        tankShadowValid &= ~tankBit(tank);
+    }
+
+    return retval;
+}
+
 #ifdef USING_ARDUINO_INTERFACE
 SimpleBLE::TankData SimpleBLE::manageUpdates(uint32_t timeout)
 {
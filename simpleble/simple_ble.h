@@ -18,6 +18,8 @@
 
 #ifdef USING_ESP32_BACKEND
 #include "esp32_backend.h"
+#elif defined(SIMPLEBLE_FRAMED_BACKEND)
+#include "framed_backend.h"
 #else
 #include "simple_ble_backend.h"
 #endif //USING_ESP32_BACKEND
@@ -29,8 +31,32 @@
 
 #define TANKS_SERVICE_UUID                                          (0xA0)
 
+// Number of tanks whose characteristic handles are prepared in addTank. Tanks
+// above it still work, just without the prepared handle.
+#ifndef SIMPLEBLE_MAX_TANKS
+#define SIMPLEBLE_MAX_TANKS                                         (8)
+#endif //SIMPLEBLE_MAX_TANKS
 
-#ifndef USING_ESP32_BACKEND
+// Bytes shared by staging and shadow buffers of tanks, see addTank.
+#ifndef SIMPLEBLE_TANK_POOL_B
+#define SIMPLEBLE_TANK_POOL_B                                       (64)
+#endif //SIMPLEBLE_TANK_POOL_B
+
+// Values a TANK_FIFO tank queues.
+#ifndef SIMPLEBLE_TANK_FIFO_DEPTH
+#define SIMPLEBLE_TANK_FIFO_DEPTH                                   (4)
+#endif //SIMPLEBLE_TANK_FIFO_DEPTH
+
+// Highest UART speed begin() may negotiate over AltSoftSerial. It is timer
+// driven, so faster speeds depend on CPU clock and interrupt load.
+#ifndef SIMPLEBLE_ALTSERIAL_MAX_BAUD
+#define SIMPLEBLE_ALTSERIAL_MAX_BAUD                                (56000)
+#endif //SIMPLEBLE_ALTSERIAL_MAX_BAUD
+
+
+#ifdef USING_ESP32_BACKEND
+typedef Esp32BackendInterface SimpleBLEInterface;
+#else
 typedef SimpleBLEBackendInterface SimpleBLEInterface;
 #endif //USING_ESP32_BACKEND
 
@@ -115,6 +141,27 @@ public:
         WRITE_CONFIRMED
     };
 
+    enum TankOption
+    {
+        TANK_NO_OPTIONS = 0x00,
+        // Only for READ tanks. writeTank only stages the value and a newer
+        // value replaces the staged one. Latest value is sent by flushTanks.
+        TANK_LATEST_VALUE = 0x01,
+        // Keep a copy of the last value written to or read from the tank.
+        // Writes of the same value are skipped, and reads are served from the
+        // copy until client writes the tank.
+        TANK_SHADOW = 0x02,
+        // Only for WRITE tanks on ESP32. Every client write is queued and
+        // readTank returns them one by one, oldest first. When queue is full
+        // oldest value is dropped, unless one of the options below is set.
+        // Queue is taken from SIMPLEBLE_CHAR_FIFO_POOL_B .
+        TANK_FIFO = 0x04,
+        // With TANK_FIFO, new value is dropped instead.
+        TANK_FIFO_DROP_NEWEST = 0x08,
+        // With TANK_FIFO, client writes are held back until there is room.
+        TANK_FIFO_BACKPRESSURE = 0x10
+    };
+
     enum TxPower
     {
         POW_N40DBM = -40,
@@ -137,9 +184,10 @@ public:
      * @param ifc Complete SimpleBLE interface, with all external dependancies.
      */
 #ifdef USING_ARDUINO_INTERFACE
-    SimpleBLE() : backend(&arduinoIf) {}
+    SimpleBLE() : backend(&arduinoIf), tankHandlesValid(0) { resetTankBuffers(); }
 #else //USING_ARDUINO_INTERFACE
-    SimpleBLE(const SimpleBLEInterface *ifc) : backend(ifc) {}
+    SimpleBLE(const SimpleBLEInterface *ifc) : backend(ifc), tankHandlesValid(0)
+    { resetTankBuffers(); }
 #endif //USING_ARDUINO_INTERFACE
 
     /**
@@ -162,7 +210,7 @@ public:
     inline void enterUltraLowPower(void) { backend.deactivateModuleRx(); }
     /**
      * @brief Reset the module via reset pin. Do this only if software reset
-     *        doesn't work.
+     *        doesn't work. It returns once module started again.
      * 
      */
     inline void hardResetModule(void) { backend.hardResetModule(); }
@@ -170,10 +218,27 @@ public:
     /**
      * @brief Initialise pins to initial values and put module to known state.
      * 
+     * @param targetBaud Highest UART speed to negotiate with the module, or 0
+     *                   to stay at default 9600 baud. Speed is lowered to what
+     *                   both sides support and falls back to 9600 if module
+     *                   doesn't respond at it. Ignored on ESP32.
+     * @return true If module was started.
+     * @return false If module didn't respond.
      */
-    bool begin();
+    bool begin(uint32_t targetBaud = 0);
 
-    TankId addTank(TankType type, uint32_t maxSizeBytes);
+    /**
+     * @brief Add a tank, a characteristic in the tanks service.
+     * 
+     * @param type Direction of the tank.
+     * @param maxSizeBytes Largest data that tank can hold.
+     * @param options TankOption flags. Each option takes a buffer of
+     *                maxSizeBytes from SIMPLEBLE_TANK_POOL_B. Options that
+     *                don't fit, or tanks above SIMPLEBLE_MAX_TANKS, are left
+     *                out and tank works without them.
+     * @return TankId Id of the new tank, or INVALID_TANK_ID on failure.
+     */
+    TankId addTank(TankType type, uint32_t maxSizeBytes, uint8_t options = TANK_NO_OPTIONS);
 
     /**
      * @brief Restart Simple BLE module via builtin command.
@@ -183,6 +248,16 @@ public:
      */
     bool softRestart(void) { return backend.softRestart(); }
 
+    /**
+     * @brief Set handler which is called while library waits for the module
+     *        or for tank updates, so application can do some work meanwhile.
+     * 
+     * @param handler Handler function or NULL.
+     * @param context Context pointer passed to handler.
+     */
+    inline void setIdleHandler(IdleHandler *handler, void *context = NULL)
+    { backend.setIdleHandler(handler, context); }
+
     /**
      * @brief Start advertising with previously constructed payload with setAdvPayload
      *        function.
@@ -253,6 +328,22 @@ public:
      */
     bool writeTank(TankId tank, const char *str);
 
+    /**
+     * @brief Send staged values of latest value tanks to the module, one write
+     *        per tank however many values were staged since the last flush.
+     * 
+     * @return true If all staged values were sent.
+     * @return false If some value wasn't sent, it is kept for the next flush
+     *               unless a newer one is staged.
+     */
+    bool flushTanks(void);
+
+    /**
+     * @brief Number of client writes a TANK_FIFO tank dropped because its
+     *        queue was full, or value didn't fit.
+     */
+    uint32_t tankOverflows(TankId tank);
+
 #ifdef USING_ARDUINO_INTERFACE
     TankData manageUpdates(uint32_t timeout=1000);
 #endif //USING_ARDUINO_INTERFACE
@@ -260,6 +351,10 @@ public:
 #ifdef USING_ESP32_BACKEND
     typedef Esp32Backend BackendNs;
     Esp32Backend backend;
+#elif defined(SIMPLEBLE_FRAMED_BACKEND)
+    // Tank traffic in binary frames where module supports them.
+    typedef FramedBackend BackendNs;
+    FramedBackend backend;
 #else
     typedef SimpleBLEBackend BackendNs;
     SimpleBLEBackend backend;
@@ -267,6 +362,57 @@ public:
 
     int8_t tanksServiceIndex;
 
+private:
+    static_assert(SIMPLEBLE_MAX_TANKS <= 32, "SIMPLEBLE_MAX_TANKS must fit in a bitmask");
+
+    BackendNs::CharHandle tankHandles[SIMPLEBLE_MAX_TANKS];
+    uint32_t tankHandlesValid;
+
+    inline const BackendNs::CharHandle *tankHandle(TankId tank)
+    {
+        return tank >= 0 && tank < SIMPLEBLE_MAX_TANKS &&
+               (tankHandlesValid & ((uint32_t)1 << tank)) ? &tankHandles[tank] : NULL;
+    }
+
+    // Value buffer of a tank, carved from tankPool.
+    struct TankBuffer
+    {
+        uint8_t *data;
+        uint16_t maxSize;
+        uint16_t size;
+    };
+
+    static_assert(SIMPLEBLE_TANK_POOL_B <= 0xFFFF, "SIMPLEBLE_TANK_POOL_B must fit in 16 bits");
+
+    uint8_t tankPool[SIMPLEBLE_TANK_POOL_B];
+    uint16_t tankPoolUsed;
+
+    // Latest values waiting for flushTanks.
+    TankBuffer tankStages[SIMPLEBLE_MAX_TANKS];
+    uint32_t tankStaged;
+    uint32_t tankDirty;
+
+    // Last values known to be in the module.
+    TankBuffer tankShadows[SIMPLEBLE_MAX_TANKS];
+    uint32_t tankShadowed;
+    uint32_t tankShadowValid;
+    uint32_t shadowLostUpdates;
+
+    // Tanks whose client writes are queued in the backend.
+    uint32_t tankFifos;
+
+    static inline uint32_t tankBit(TankId tank)
+    {
+        return tank >= 0 && tank < SIMPLEBLE_MAX_TANKS ? (uint32_t)1 << tank : 0;
+    }
+
+    void resetTankBuffers(void);
+    bool allocTankBuffer(TankBuffer *buffer, uint32_t maxSizeBytes);
+    bool shadowCurrent(TankId tank);
+    void setShadow(TankId tank, const uint8_t *data, uint32_t dataSize);
+    bool sendTank(TankId tank, const uint8_t *data, uint32_t dataSize);
+public:
+
 #ifdef USING_ARDUINO_INTERFACE
 private:
 // AltSoft lib uses these RX and TX pins for communication but it doesn't
@@ -279,6 +425,9 @@ private:
 #ifdef USING_ESP32_BACKEND
     static const Esp32BackendInterface arduinoIf;
 #else
+    // AltSoftSerial is bound to one hardware timer and its fixed pins, so
+    // there can be only one on a board. Additional modules are driven through
+    // their own SimpleBLEInterface on other builds.
     static AltSoftSerial altSerial;
 
     static const SimpleBLEBackendInterface arduinoIf;
@@ -5,19 +5,85 @@
 #include <string.h>
 
 
+// Module UART hands received bytes over in blocks of this size. Partial
+// block waits for UART receive timeout, see SIMPLEBLE_RX_BLOCK_FILL.
 #define MODULE_RX_BLOCK_SIZE_B                                  (6)
+#define MODULE_RX_BLOCK_FILL                                    ('\n')
+// Idle time after which module takes a partial block anyway. At low speeds
+// filler takes longer than that, so it is not sent.
+#define MODULE_RX_TIMEOUT_US                                    (2000)
+#define MAX_RESPONSE_LEN_B                                      (100)
+// Longest characteristic command, "AT+WRITECHAR=255,255,4294967295" with
+// command ending and terminator.
+#define CHAR_CMD_LEN_B                                          (36)
+// Conservative amount of command bytes that module can buffer while it is
+// processing the previous command.
+#define MODULE_RX_BUFFER_B                                      (64)
+// Time module has to answer AT command after speed change.
+#define BAUD_PROBE_TIMEOUT_MS                                   (200)
+#define MODULE_START_TIMEOUT_MS                                 (5000)
 
 static const char cmdEnding[] = "\r";
 static const char cmdAck[] = "\nOK\r\n";
 static const char cmdError[] = "ERROR\r\n";
 
+// Speeds accepted by AT+SETBAUD, in ascending order.
+static const uint32_t moduleBauds[] = {
+    1200, 2400, 4800, 9600, 14400, 19200, 28800, 31250, 38400, 56000, 76800,
+    115200, 230400, 250000, 460800, 921600, 1000000
+};
+
+// ^ADDSRV: <index>
+static const AtLineSchema addSrvSchema = { "^ADDSRV:", 1 };
+// ^ADDCHAR: <index>
+static const AtLineSchema addCharSchema = { "^ADDCHAR:", 1 };
+// ^READCHAR: <size>,<new data>
+static const AtLineSchema readCharSchema = { "^READCHAR:", 2 };
+// ^CHARWRITE: <service>,<char>,<size>
+static const AtLineSchema charWriteSchema = { "^CHARWRITE:", 3 };
+
+// Order must follow SimpleBLEBackend::UrcType. Response prefixes have no
+// handler, so they stay in command responses.
+const AtUrcEntry SimpleBLEBackend::urcTable[] = {
+    { "^START",     NULL },
+    { "^CHARWRITE", SimpleBLEBackend::charWriteUrc },
+    { "^ADDSRV:",   NULL },
+    { "^ADDCHAR:",  NULL },
+    { "^READCHAR:", NULL },
+};
+
 
 SimpleBLEBackend::SimpleBLEBackend(const SimpleBLEBackendInterface *ifc) :
     ifc(ifc),
-    at(ifc->serialPut, ifc->serialGet, ifc->delayMs, ifc->millis, NULL)
+    at(ifc->serialPut, ifc->serialGet, ifc->delayMs, ifc->millis, NULL,
+       ifc->serialWrite, ifc->serialRead, ifc->waitRx),
+    hostBaud(SIMPLEBLE_DEFAULT_BAUD),
+    targetBaud(0),
+    pipelineDepth(1),
+    pipelineMaxBytes(MODULE_RX_BUFFER_B),
+    queueStatus(AtProcess::SUCCESS),
+    cmdDoneHandler(NULL),
+    cmdDoneContext(NULL),
+    charUpdatesHead(0),
+    charUpdatesLen(0),
+    charUpdatesLost(0)
 {
-    Timeout::init(ifc->millis);
-    unprocessedUrc[0] = '\0';
+    at.setDoneHandler(
+        [](int8_t ticket, AtProcess::Status status, void *context)
+        {
+            SimpleBLEBackend *owner = (SimpleBLEBackend*)context;
+
+            if( owner->queueStatus == AtProcess::SUCCESS )
+            {
+                owner->queueStatus = status;
+            }
+
+            if( owner->cmdDoneHandler )
+            {
+                owner->cmdDoneHandler(ticket, status, owner->cmdDoneContext);
+            }
+        },
+        this);
 }
 
 void SimpleBLEBackend::activateModuleRx(void)
@@ -34,6 +100,16 @@ void SimpleBLEBackend::hardResetModule(void)
     ifc->moduleResetSet(false);
     ifc->delayMs(10);
     ifc->moduleResetSet(true);
+
+    // Partial line received before reset would hide ^START.
+    at.discardInput();
+    resetHostBaud();
+    at.waitURC("^START", NULL, 0, MODULE_START_TIMEOUT_MS);
+
+    if( targetBaud )
+    {
+        negotiateBaud(targetBaud);
+    }
 }
 
 void SimpleBLEBackend::begin()
@@ -42,6 +118,9 @@ void SimpleBLEBackend::begin()
       cmdEnding,
       cmdAck,
       cmdError,
+      urcTable,
+      sizeof(urcTable)/sizeof(urcTable[0]),
+      this,
     };
     at.init(&s);
     deactivateModuleRx();
@@ -80,26 +159,39 @@ AtProcess::Status SimpleBLEBackend::sendReceiveCmd(const char *cmd,
 {
     AtProcess::Status cmdStatus = AtProcess::GEN_ERROR;
 
-    if( response )
+    // Waiting for queued commands counts against the same timeout.
+    Deadline cmdDeadline(ifc->millis, timeout);
+
+    // Commands that need their response can't be pipelined, so wait for the
+    // queued ones first.
+    if( at.responsesInFlight() )
     {
-        response[0] = '\0';
+        flushQueueUntil(cmdDeadline);
     }
 
-    // Check if there are some unprocessed URCs before we execute a new command
+    if( startCmd(cmd, buff, size, readNWrite, cmdDeadline.left(), response) )
     {
-        char lineBuff[80+1];
-        uint32_t lineLen = 0;
-        do
-        {
-            lineLen = at.getLine(lineBuff, sizeof(lineBuff)-1, 5);
+        cmdStatus = at.waitResponse();
+    }
+    else if( at.responseStatus().status == AtProcess::IN_PROGRESS )
+    {
+        // Link is still busy with an earlier command.
+        cmdStatus = AtProcess::TIMEOUT;
+    }
 
-            if( lineBuff[0] >= ' ' )
-            {
-                strncpy(unprocessedUrc, lineBuff, sizeof(unprocessedUrc));
-                unprocessedUrc[sizeof(unprocessedUrc)-1] = '\0';
-            }
+    return cmdStatus;
+}
 
-        }while(lineLen);
+bool SimpleBLEBackend::startCmd(const char *cmd,
+                                uint8_t *buff,
+                                uint32_t size,
+                                bool readNWrite,
+                                uint32_t timeout,
+                                char *response)
+{
+    if( !prepareCmd(cmd, buff, size, readNWrite, timeout, response) )
+    {
+        return false;
     }
 
     // We will get an echo of this command uninterrupted with URCs because we
@@ -111,41 +203,190 @@ AtProcess::Status SimpleBLEBackend::sendReceiveCmd(const char *cmd,
         // We are writing.
         sent += at.write(buff, size);
     }
-    if( sent > 0 )
+
+    // Filler goes after data, so it isn't mistaken for a part of it.
+    fillRxBlock(sent);
+
+    return sent > 0;
+}
+
+bool SimpleBLEBackend::prepareCmd(const char *cmd,
+                                  uint8_t *buff,
+                                  uint32_t size,
+                                  bool readNWrite,
+                                  uint32_t timeout,
+                                  char *response)
+{
+    Deadline cmdDeadline(ifc->millis, timeout);
+
+    if( response )
     {
-        // Now is the time to start checking for read data.
-        if( readNWrite && buff )
-        {
-            char lineBuff[80+1];
-            uint32_t lineLen = 0;
+        response[0] = '\0';
+    }
 
-            // Protect for later string operations.
-            lineBuff[0] = '\0';
-            lineBuff[sizeof(lineBuff)-1] = '\0';
+    // Dispatch URCs that arrived since the last command. Only one command can
+    // be in flight at a time.
+    if( at.poll() == AtProcess::IN_PROGRESS )
+    {
+        return false;
+    }
 
-            do
-            {
-                lineLen = at.getLine(lineBuff, sizeof(lineBuff)-1, 1000);
-                internalDebug(lineBuff);
+    // Time spent on earlier URCs counts against the command timeout.
+    at.startResponse(cmd,
+                     response, response ? MAX_RESPONSE_LEN_B : 0,
+                     cmdDeadline.left(),
+                     true,
+                     readNWrite ? buff : NULL, readNWrite ? size : 0);
 
-            }while(lineLen && strncmp(cmd, lineBuff, strlen(cmd)) != 0);
+    return true;
+}
 
-            if( lineLen )
-            {
-                // Read one line because it is still not the data.
-                lineLen = at.getLine(lineBuff, sizeof(lineBuff)-1, 1000);
-                internalDebug(lineBuff);
+AtProcess::Status SimpleBLEBackend::sendReceiveCharCmd(char *cmdStr, uint8_t cmdLen,
+                                                       uint8_t *buff, uint32_t size,
+                                                       bool readNWrite)
+{
+    AtProcess::Status cmdStatus = AtProcess::GEN_ERROR;
 
-                at.readBytesBlocking(buff, size);
-            }
+    Deadline cmdDeadline(ifc->millis, 3000);
+
+    if( at.responsesInFlight() )
+    {
+        flushQueueUntil(cmdDeadline);
+    }
+
+    if( prepareCmd(cmdStr, buff, size, readNWrite, cmdDeadline.left(), NULL) )
+    {
+        // Command header goes out in one write, data follows it.
+        uint32_t sent = at.sendCommand(cmdStr, cmdLen, CHAR_CMD_LEN_B);
+
+        if( !readNWrite && buff )
+        {
+            sent += at.write(buff, size);
         }
 
-        cmdStatus = at.recvResponseWaitOk(timeout, response, 100);
+        fillRxBlock(sent);
+
+        if( sent > 0 )
+        {
+            cmdStatus = at.waitResponse();
+        }
+    }
+    else if( at.responseStatus().status == AtProcess::IN_PROGRESS )
+    {
+        // Link is still busy with an earlier command.
+        cmdStatus = AtProcess::TIMEOUT;
     }
 
     return cmdStatus;
 }
 
+AtProcess::Status SimpleBLEBackend::pollCmd(void)
+{
+    return at.poll();
+}
+
+void SimpleBLEBackend::setPipeline(uint8_t depth, uint32_t maxInFlightBytes)
+{
+    depth = depth < AT_PIPELINE_MAX_DEPTH ? depth : AT_PIPELINE_MAX_DEPTH;
+    pipelineDepth = depth > 0 ? depth : 1;
+    pipelineMaxBytes = maxInFlightBytes;
+}
+
+void SimpleBLEBackend::setIdleHandler(IdleHandler *handler, void *context)
+{
+    at.setIdleHandler(handler, context);
+}
+
+void SimpleBLEBackend::setGapTimeout(uint32_t gap)
+{
+    at.setGapTimeout(gap);
+}
+
+void SimpleBLEBackend::setCmdDoneHandler(AtProcess::DoneHandler *handler, void *context)
+{
+    cmdDoneHandler = handler;
+    cmdDoneContext = context;
+}
+
+int8_t SimpleBLEBackend::queueCmd(const char *cmd,
+                                  const uint8_t *data,
+                                  uint32_t dataSize,
+                                  uint32_t timeout)
+{
+    int8_t ticket = -1;
+
+    uint32_t bytes = strlen(cmd) + strlen(cmdEnding) + (data ? dataSize : 0);
+
+    Deadline roomDeadline(ifc->millis, timeout);
+
+    // Wait until module has room for this command.
+    while( at.responsesInFlight() >= pipelineDepth ||
+           (at.responsesInFlight() &&
+            at.bytesInFlight() + bytes > pipelineMaxBytes) )
+    {
+        at.poll();
+
+        if( roomDeadline.expired() )
+        {
+            return ticket;
+        }
+
+        at.waitInput(roomDeadline.remaining());
+    }
+
+    // Filler is sent after the command, but it is in flight with it.
+    uint32_t fillLen = rxBlockFillLen(bytes);
+
+    ticket = at.queueResponse(cmd, bytes + fillLen, timeout);
+
+    // If sending fails response never comes, and command times out.
+    if( ticket >= 0 )
+    {
+        at.sendCommand(cmd);
+
+        if( data )
+        {
+            at.write(data, dataSize);
+        }
+
+        writeRxFill(fillLen);
+    }
+
+    return ticket;
+}
+
+AtProcess::Status SimpleBLEBackend::pollQueue(void)
+{
+    at.poll();
+
+    return at.responsesInFlight() ? AtProcess::IN_PROGRESS : queueStatus;
+}
+
+AtProcess::Status SimpleBLEBackend::flushQueue(uint32_t timeout)
+{
+    Deadline flushDeadline(ifc->millis, timeout);
+
+    return flushQueueUntil(flushDeadline);
+}
+
+AtProcess::Status SimpleBLEBackend::flushQueueUntil(Deadline &deadline)
+{
+    while( pollQueue() == AtProcess::IN_PROGRESS )
+    {
+        if( deadline.expired() )
+        {
+            return AtProcess::TIMEOUT;
+        }
+
+        at.waitInput(deadline.remaining());
+    }
+
+    AtProcess::Status status = queueStatus;
+    queueStatus = AtProcess::SUCCESS;
+
+    return status;
+}
+
 
 bool SimpleBLEBackend::softRestart(void)
 {
@@ -160,12 +401,97 @@ bool SimpleBLEBackend::softRestart(void)
     }
     else
     {
-        at.waitURC("^START", NULL, 0, 5000);
+        // Module restarts at default speed, ^START already comes at it.
+        resetHostBaud();
+        at.waitURC("^START", NULL, 0, MODULE_START_TIMEOUT_MS);
+
+        if( targetBaud )
+        {
+            negotiateBaud(targetBaud);
+        }
     }
 
     return retval;
 }
 
+uint32_t SimpleBLEBackend::negotiateBaud(uint32_t newTargetBaud)
+{
+    targetBaud = newTargetBaud;
+
+    uint32_t wantedBaud = targetBaud ? targetBaud : SIMPLEBLE_DEFAULT_BAUD;
+
+    for(int8_t i = sizeof(moduleBauds)/sizeof(moduleBauds[0]) - 1;
+        i >= 0 && ifc->serialSetBaud; i--)
+    {
+        uint32_t candidate = moduleBauds[i];
+
+        if( candidate > wantedBaud )
+        {
+            continue;
+        }
+
+        if( candidate == hostBaud )
+        {
+            break;
+        }
+
+        // Host has to support the speed before module is switched to it,
+        // otherwise there is no way to switch the module back.
+        if( !ifc->serialSetBaud(candidate) )
+        {
+            continue;
+        }
+        ifc->serialSetBaud(hostBaud);
+
+        char cmdStr[24]; cmdStr[0] = '\0';
+        strcat(cmdStr, "AT+SETBAUD=");
+        utilityUtoa(candidate, &cmdStr[strlen(cmdStr)]);
+
+        AtProcess::Status status = sendReceiveCmd(cmdStr);
+
+        if( status == AtProcess::GEN_ERROR )
+        {
+            continue;
+        }
+        else if( status != AtProcess::SUCCESS )
+        {
+            break;
+        }
+
+        // New speed applies when RX enable pin goes from low to high.
+        deactivateModuleRx();
+        ifc->serialSetBaud(candidate);
+        hostBaud = candidate;
+        activateModuleRx();
+        at.discardInput();
+
+        if( sendReceiveCmd("AT", BAUD_PROBE_TIMEOUT_MS) != AtProcess::SUCCESS )
+        {
+            internalDebug("No response after speed change\r\n");
+
+            // Reset puts module back to default speed, which is kept until
+            // the next restart. Target stays, it is tried again then.
+            uint32_t keptTargetBaud = targetBaud;
+            targetBaud = 0;
+            hardResetModule();
+            targetBaud = keptTargetBaud;
+        }
+
+        break;
+    }
+
+    return hostBaud;
+}
+
+void SimpleBLEBackend::resetHostBaud(void)
+{
+    if( hostBaud != SIMPLEBLE_DEFAULT_BAUD &&
+        ifc->serialSetBaud(SIMPLEBLE_DEFAULT_BAUD) )
+    {
+        hostBaud = SIMPLEBLE_DEFAULT_BAUD;
+    }
+}
+
 bool SimpleBLEBackend::startAdvertisement(uint32_t advPeriod,
                                    int32_t advDuration,
                                    bool restartOnDisc)
@@ -256,18 +582,16 @@ int8_t SimpleBLEBackend::addService(uint8_t servUuid)
     strcat(cmdStr, "AT+ADDSRV=");
     char helpStr[20];
 
-    char response[100];
-
     utilityItoa(servUuid, helpStr, sizeof(helpStr));
     strcat(cmdStr, helpStr);
 
-    if( sendReceiveCmd(cmdStr, 3000, response) == AtProcess::SUCCESS )
+    if( sendReceiveCmd(cmdStr) == AtProcess::SUCCESS )
     {
-        const char *retStatus = findCmdReturnStatus(response, "^ADDSRV:");
+        int32_t fields[1];
 
-        if( retStatus )
+        if( parseResponse(&addSrvSchema, fields) )
         {
-            srvIndex = utilityAtoi(retStatus);
+            srvIndex = fields[0];
         }
     }
     
@@ -282,8 +606,6 @@ int8_t SimpleBLEBackend::addChar(uint8_t serviceIndex, uint32_t maxSize, CharPro
     strcat(cmdStr, "AT+ADDCHAR=");
     char helpStr[20];
 
-    char response[50];
-
     utilityItoa(serviceIndex, helpStr, sizeof(helpStr));
     strcat(cmdStr, helpStr);
     strcat(cmdStr, ",");
@@ -293,13 +615,13 @@ int8_t SimpleBLEBackend::addChar(uint8_t serviceIndex, uint32_t maxSize, CharPro
     utilityItoa(flags, helpStr, sizeof(helpStr));
     strcat(cmdStr, helpStr);
 
-    if( sendReceiveCmd(cmdStr, 3000, response) == AtProcess::SUCCESS )
+    if( sendReceiveCmd(cmdStr) == AtProcess::SUCCESS )
     {
-        const char *retStatus = findCmdReturnStatus(response, "^ADDCHAR:");
+        int32_t fields[1];
 
-        if( retStatus )
+        if( parseResponse(&addCharSchema, fields) )
         {
-            charIndex = utilityAtoi(retStatus);
+            charIndex = fields[0];
         }
     }
 
@@ -311,46 +633,63 @@ int32_t SimpleBLEBackend::checkChar(uint8_t serviceIndex, uint8_t charIndex)
     return readChar(serviceIndex, charIndex, NULL, 0);
 }
 
+bool SimpleBLEBackend::makeCharHandle(uint8_t serviceIndex, uint8_t charIndex,
+                                      CharHandle *handle)
+{
+    handle->serviceIndex = serviceIndex;
+    handle->charIndex = charIndex;
+
+    char *args = utilityUtoa(serviceIndex, handle->args);
+    *args++ = ',';
+    args = utilityUtoa(charIndex, args);
+    *args++ = ',';
+
+    handle->argsLen = args - handle->args;
+
+    return true;
+}
+
 int32_t SimpleBLEBackend::readChar(uint8_t serviceIndex, uint8_t charIndex,
                             uint8_t *buff, uint32_t buffSize)
 {
-    char cmdStr[50]; cmdStr[0] = '\0';
-    strcat(cmdStr, "AT+READCHAR=");
-    char helpStr[20];
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return readChar(handle, buff, buffSize);
+}
+
+int32_t SimpleBLEBackend::readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize)
+{
+    char cmdStr[CHAR_CMD_LEN_B];
 
     int32_t readBytes = buffSize;
 
     bool returnData = buff ? true : false ;
 
-    utilityItoa(serviceIndex, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
-    strcat(cmdStr, ",");
-    utilityItoa(charIndex, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
-    strcat(cmdStr, ",");
-    utilityItoa(returnData, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
-
+    uint8_t cmdLen = buildCharCmd(cmdStr, "AT+READCHAR=", handle, returnData);
 
     if( returnData )
     {
-        if( sendReadReceiveCmd(cmdStr, buff, buffSize) == AtProcess::SUCCESS )
+        readBytes = -1;
+
+        // Module tells the data length, so at most buffSize bytes are stored
+        // and the rest is dropped.
+        if( sendReceiveCharCmd(cmdStr, cmdLen, buff, buffSize, true) == AtProcess::SUCCESS )
         {
+            readBytes = at.responseStatus().dataTotal;
         }
     }
     else
     {
-        char response[100];
-
-        if( sendReceiveCmd(cmdStr, 3000, response) == AtProcess::SUCCESS )
+        if( sendReceiveCharCmd(cmdStr, cmdLen, NULL, 0, false) == AtProcess::SUCCESS )
         {
-            const char *retStatus = findCmdReturnStatus(response, "^READCHAR:");
+            int32_t fields[2];
 
-            if( retStatus )
+            if( parseResponse(&readCharSchema, fields) )
             {
-                readBytes = utilityAtoi(retStatus);
+                readBytes = fields[0];
 
-                bool newData = utilityAtoi(strpbrk(retStatus, ",")+1);
+                bool newData = fields[1];
 
                 // If there is no new data to be read, make bytes available to
                 // read negative.
@@ -368,23 +707,21 @@ int32_t SimpleBLEBackend::readChar(uint8_t serviceIndex, uint8_t charIndex,
 bool SimpleBLEBackend::writeChar(uint8_t serviceIndex, uint8_t charIndex,
                                  const uint8_t *data, uint32_t dataSize)
 {
-    bool retval = false;
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
 
-    char cmdStr[50]; cmdStr[0] = '\0';
-    strcat(cmdStr, "AT+WRITECHAR=");
-    char helpStr[20];
+    return writeChar(handle, data, dataSize);
+}
 
-    utilityItoa(serviceIndex, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
-    strcat(cmdStr, ",");
-    utilityItoa(charIndex, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
-    strcat(cmdStr, ",");
-    utilityItoa(dataSize, helpStr, sizeof(helpStr));
-    strcat(cmdStr, helpStr);
+bool SimpleBLEBackend::writeChar(const CharHandle &handle,
+                                 const uint8_t *data, uint32_t dataSize)
+{
+    bool retval = false;
 
+    char cmdStr[CHAR_CMD_LEN_B];
+    uint8_t cmdLen = buildCharCmd(cmdStr, "AT+WRITECHAR=", handle, dataSize);
 
-    if( sendWriteReceiveCmd(cmdStr, (uint8_t*)data, dataSize) == AtProcess::SUCCESS )
+    if( sendReceiveCharCmd(cmdStr, cmdLen, (uint8_t*)data, dataSize, false) == AtProcess::SUCCESS )
     {
         retval = true;
     }
@@ -392,34 +729,69 @@ bool SimpleBLEBackend::writeChar(uint8_t serviceIndex, uint8_t charIndex,
     return retval;
 }
 
+int8_t SimpleBLEBackend::writeCharQueued(uint8_t serviceIndex, uint8_t charIndex,
+                                         const uint8_t *data, uint32_t dataSize)
+{
+    CharHandle handle;
+    makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return writeCharQueued(handle, data, dataSize);
+}
+
+int8_t SimpleBLEBackend::writeCharQueued(const CharHandle &handle,
+                                         const uint8_t *data, uint32_t dataSize)
+{
+    char cmdStr[CHAR_CMD_LEN_B];
+    buildCharCmd(cmdStr, "AT+WRITECHAR=", handle, dataSize);
+
+    return queueCmd(cmdStr, data, dataSize);
+}
+
+uint8_t SimpleBLEBackend::buildCharCmd(char *cmdStr, const char *cmd,
+                                       const CharHandle &handle, uint32_t lastArg)
+{
+    uint8_t cmdLen = strlen(cmd);
+
+    memcpy(cmdStr, cmd, cmdLen);
+    memcpy(&cmdStr[cmdLen], handle.args, handle.argsLen);
+
+    return utilityUtoa(lastArg, &cmdStr[cmdLen + handle.argsLen]) - cmdStr;
+}
+
 bool SimpleBLEBackend::waitCharUpdate(uint8_t* serviceIndex, uint8_t* charIndex,
                                   uint32_t* dataSize, uint32_t timeout)
 {
-    const char charwriteUrc[] = "^CHARWRITE";
-
     bool retval = false;
 
-    char urcBuff[40];
+    Timeout updateTimeout(ifc->millis, timeout);
 
 do{
-    if( unprocessedUrc[0] && strncmp(unprocessedUrc, charwriteUrc, strlen(charwriteUrc)) == 0 )
+    // Updates received during earlier commands are already queued.
+    while( !charUpdatesLen )
     {
-        strncpy(urcBuff, unprocessedUrc, sizeof(urcBuff));
-        unprocessedUrc[0] = '\0';
+        at.poll();
+
+        if( charUpdatesLen || updateTimeout.expired() )
+        {
+            break;
+        }
+
+        at.waitInput(updateTimeout.remaining());
     }
-    else if( at.waitURC(charwriteUrc, urcBuff, sizeof(urcBuff), timeout) == 0 )
+
+    if( !charUpdatesLen )
     {
         break;
     }
 
-    char *urcStart = urcBuff; while(*urcStart != '^') urcStart++;
-    char *infoParse = &urcStart[12];
+    const CharUpdate &update = charUpdates[charUpdatesHead];
+
+    *serviceIndex = update.serviceIndex;
+    *charIndex = update.charIndex;
+    *dataSize = update.dataSize;
 
-    *serviceIndex = utilityAtoi(infoParse);
-    infoParse = strpbrk(infoParse, ",") + 1;
-    *charIndex = utilityAtoi(infoParse);
-    infoParse = strpbrk(infoParse, ",") + 1;
-    *dataSize = utilityAtoi(infoParse);
+    charUpdatesHead = (charUpdatesHead + 1) % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN;
+    charUpdatesLen--;
 
     retval = true;
 
@@ -428,131 +800,178 @@ do{
     return retval;
 }
 
-const char *SimpleBLEBackend::findCmdReturnStatus(const char *cmdRet, const char *statStart)
+bool SimpleBLEBackend::charUpdatePending(uint8_t serviceIndex, uint8_t charIndex)
 {
-    const char *retStatus = strstr(cmdRet, statStart);
+    at.poll();
 
-    if( retStatus )
+    for(uint8_t i = 0; i < charUpdatesLen; i++)
     {
-        retStatus += strlen(statStart);
+        const CharUpdate &update = charUpdates[(charUpdatesHead + i) % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+
+        if( update.serviceIndex == serviceIndex && update.charIndex == charIndex )
+        {
+            return true;
+        }
     }
 
-    return retStatus;
+    return false;
 }
 
-void SimpleBLEBackend::debugPrint(const char *str)
+void SimpleBLEBackend::charWriteUrc(const LineView &line, int8_t urc, void *context)
 {
-    internalDebug(str);
-    internalDebug("\r\n");
-}
+    (void)urc;
 
-uint32_t SimpleBLEBackend::utilityItoa(int32_t value, char *strBuff, uint32_t strBuffSize)
-{
-    const uint32_t base = 10;
-    // Store information about sign.
-    bool isPositive = value >= 0 ? true : false;
-    uint32_t writtenDigits = 0;
+    SimpleBLEBackend *owner = (SimpleBLEBackend*)context;
+    AtLineParser parser;
+    int32_t fields[3];
 
-    // We want to work with positive number.
-    if( !isPositive )
-    {
-        value *= -1;
-    }
+    parser.start(&charWriteSchema, fields);
 
-    // To store all digits of a number we will use this union.
-    union
+    if( parser.parse(line) != AtLineParser::PARSED )
     {
-        uint32_t raw[2];
-        struct
-        {
-            uint8_t downer : 4 ;
-            uint8_t upper : 4 ;
-        } bytePair[8];
-    } digits;
+        owner->debugPrint("Malformed ^CHARWRITE");
+        return;
+    }
 
-    memset(digits.raw, 0x00, sizeof(digits.raw));
+    owner->queueCharUpdate(fields[0], fields[1], fields[2]);
+}
 
-    // Extract digits from a number.
-    uint32_t numDigits = value == 0 ? 1 : 0 ;
-    for(; value && numDigits < sizeof(digits.bytePair)*2; numDigits++)
+void SimpleBLEBackend::queueCharUpdate(uint8_t serviceIndex, uint8_t charIndex,
+                                       uint32_t dataSize)
+{
+    // Characteristic holds only its latest value, so an update that is already
+    // waiting just takes the new size.
+    for(uint8_t i = 0; i < charUpdatesLen; i++)
     {
-        uint8_t digit = value%base;
+        CharUpdate &update = charUpdates[(charUpdatesHead + i) % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
 
-        value /= base;
-
-        if( numDigits%2 == 0 )
-        {
-            digits.bytePair[numDigits/2].downer = digit;
-        }
-        else
+        if( update.serviceIndex == serviceIndex && update.charIndex == charIndex )
         {
-            digits.bytePair[numDigits/2].upper = digit;
+            update.dataSize = dataSize;
+            return;
         }
     }
 
-    // Add sign.
-    if( !isPositive )
+    if( charUpdatesLen >= SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN )
     {
-        strBuff[0] = '-';
-        // Increment pointer by one for convinience in for loop.
-        strBuff++;
-        writtenDigits++;
+        charUpdatesLost++;
+        return;
     }
 
-    // Write digits to a string array.
-    for(int i = 0; i < numDigits && writtenDigits < strBuffSize; i++, writtenDigits++)
-    {
-        uint32_t digitIterator = numDigits - i - 1;
-        if( digitIterator%2 == 0 )
-        {
-            strBuff[i] = digits.bytePair[digitIterator/2].downer + '0';
-        }
-        else
-        {
-            strBuff[i] = digits.bytePair[digitIterator/2].upper + '0';
-        }
-    }
-    // Now that we are done with for loop return buffer pointer to original value.
-    isPositive ? 0 : strBuff--;
+    CharUpdate &update = charUpdates[(charUpdatesHead + charUpdatesLen) % SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+    update.serviceIndex = serviceIndex;
+    update.charIndex = charIndex;
+    update.dataSize = dataSize;
+    charUpdatesLen++;
+}
 
-    // Finish string with a null terminator.
-    if( writtenDigits < strBuffSize )
+uint32_t SimpleBLEBackend::rxBlockFillLen(uint32_t sentBytes)
+{
+    uint32_t fillLen = (MODULE_RX_BLOCK_SIZE_B - sentBytes % MODULE_RX_BLOCK_SIZE_B) %
+                       MODULE_RX_BLOCK_SIZE_B;
+
+    // Each byte takes 10 bits on the wire.
+    if( !SIMPLEBLE_RX_BLOCK_FILL ||
+        fillLen * (10000000UL / hostBaud) > MODULE_RX_TIMEOUT_US )
     {
-        strBuff[writtenDigits] = '\0';
+        fillLen = 0;
     }
-    else
+
+    return fillLen;
+}
+
+uint32_t SimpleBLEBackend::writeRxFill(uint32_t fillLen)
+{
+    static const uint8_t fill[MODULE_RX_BLOCK_SIZE_B] = {
+        MODULE_RX_BLOCK_FILL, MODULE_RX_BLOCK_FILL, MODULE_RX_BLOCK_FILL,
+        MODULE_RX_BLOCK_FILL, MODULE_RX_BLOCK_FILL, MODULE_RX_BLOCK_FILL
+    };
+
+    return fillLen ? at.write(fill, fillLen) : 0;
+}
+
+uint32_t SimpleBLEBackend::fillRxBlock(uint32_t sentBytes)
+{
+    return writeRxFill(rxBlockFillLen(sentBytes));
+}
+
+bool SimpleBLEBackend::parseResponse(const AtLineSchema *schema, int32_t *fields)
+{
+    AtLineParser parser;
+
+    parser.start(schema, fields);
+
+    // Response line is parsed in place, straight from the receive ring.
+    if( parser.parse(at.responseLine()) != AtLineParser::PARSED )
     {
-        strBuff[0] = '\0';
-        writtenDigits = 0;
+        internalDebug("Malformed response to ");
+        debugPrint(schema->prefix);
+        return false;
     }
 
-    return writtenDigits;
+    return true;
 }
 
-int32_t SimpleBLEBackend::utilityAtoi(const char* asciiInt)
+void SimpleBLEBackend::debugPrint(const char *str)
 {
-    int32_t retval = 0;
+    internalDebug(str);
+    internalDebug("\r\n");
+}
 
-    while( *asciiInt == ' ' ) asciiInt++;
+char *SimpleBLEBackend::utilityUtoa(uint32_t value, char *str)
+{
+    char digits[10];
+    uint8_t numDigits = 0;
 
-    int32_t sign = 1;
+    // 16 bit division is much cheaper on 8 bit targets, so 32 bit one is used
+    // only for the upper digits.
+    for(; value > 0xFFFF; numDigits++)
+    {
+        digits[numDigits] = '0' + value%10;
+        value /= 10;
+    }
+
+    uint16_t smallValue = value;
+    do
+    {
+        digits[numDigits++] = '0' + smallValue%10;
+        smallValue /= 10;
+    }while( smallValue );
+
+    while( numDigits )
+    {
+        *str++ = digits[--numDigits];
+    }
+    *str = '\0';
+
+    return str;
+}
 
-    if( *asciiInt == '-' )
+uint32_t SimpleBLEBackend::utilityItoa(int32_t value, char *strBuff, uint32_t strBuffSize)
+{
+    // Sign, 10 digits and terminator.
+    char numStr[12];
+    char *numEnd = numStr;
+
+    if( value < 0 )
     {
-        sign = -1;
-        asciiInt++;
+        *numEnd++ = '-';
     }
-    else if( *asciiInt == '+' )
+    numEnd = utilityUtoa(value < 0 ? -(uint32_t)value : value, numEnd);
+
+    uint32_t writtenDigits = numEnd - numStr;
+
+    // Number that doesn't fit results in empty string.
+    if( writtenDigits >= strBuffSize )
     {
-        asciiInt++;
+        writtenDigits = 0;
     }
 
-    while( *asciiInt >= '0' && *asciiInt <= '9' )
+    if( strBuffSize )
     {
-        retval *= 10;
-        retval += *asciiInt - '0';
-        asciiInt++;
+        memcpy(strBuff, numStr, writtenDigits);
+        strBuff[writtenDigits] = '\0';
     }
 
-    return sign*retval;
+    return writtenDigits;
 }
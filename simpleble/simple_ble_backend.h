@@ -2,10 +2,28 @@
 #define __SIMPLE_BLE_BACKEND_H__
 
 #include "at_process.h"
+#include "at_parser.h"
 
 #include <stdint.h>
 
 
+// Number of distinct characteristic updates that can wait for waitCharUpdate.
+#ifndef SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN
+#define SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN     (8)
+#endif //SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN
+
+// Set to 1 to pad commands with line feeds that complete the last 6-byte block
+// of the module UART, so it isn't held until the UART receive timeout. Only
+// the host simulator is known to skip line feeds between commands, module
+// firmware doesn't document it, so padding is off by default.
+#ifndef SIMPLEBLE_RX_BLOCK_FILL
+#define SIMPLEBLE_RX_BLOCK_FILL             (0)
+#endif //SIMPLEBLE_RX_BLOCK_FILL
+
+// UART speed of the module after power up and after every reset.
+#define SIMPLEBLE_DEFAULT_BAUD              (9600)
+
+
 /**
  * @brief Simple BLE interface structure
  * 
@@ -23,6 +41,21 @@
  *                by specified number of milliseconds.
  * @param debugPrint Optional Function pointer to a function that prints
  *                   various debug information to desired output.
+ * @param serialWrite Optional Function pointer to a function that writes
+ *                    a block of bytes to serial interface and returns the
+ *                    number of bytes written. If NULL serialPut is used.
+ * @param serialRead Optional Function pointer to a function that reads up to
+ *                   requested number of bytes from serial interface, without
+ *                   blocking, and returns the number of bytes read. If NULL
+ *                   serialGet is used.
+ * @param waitRx Optional Function pointer to a function that blocks until
+ *               serial interface has received data or given number of
+ *               milliseconds passes, for example by waiting on an RX interrupt
+ *               or a semaphore. If NULL delayMs(1) is used between polls.
+ * @param serialSetBaud Optional Function pointer to a function that changes
+ *                      serial interface speed. It returns false and leaves
+ *                      speed unchanged if host can't use the given speed. If
+ *                      NULL speed stays at SIMPLEBLE_DEFAULT_BAUD.
  */
 struct SimpleBLEBackendInterface
 {
@@ -33,6 +66,10 @@ struct SimpleBLEBackendInterface
     uint32_t (*const millis)(void);
     void (*const delayMs)(uint32_t);
     void (*const debugPrint)(const char*);
+    uint32_t (*const serialWrite)(const uint8_t*, uint32_t);
+    uint32_t (*const serialRead)(uint8_t*, uint32_t);
+    bool (*const waitRx)(uint32_t);
+    bool (*const serialSetBaud)(uint32_t);
 };
 
 
@@ -42,6 +79,18 @@ class SimpleBLEBackend
 public:
     static const int8_t INVALID_SERVICE_INDEX = -1;
 
+    /**
+     * @brief Characteristic address with the "<service>,<char>," part of its
+     *        commands formatted in advance, see @ref makeCharHandle .
+     */
+    struct CharHandle
+    {
+        uint8_t serviceIndex;
+        uint8_t charIndex;
+        uint8_t argsLen;
+        char args[8];
+    };
+
     enum AdvType
     {
         INVALID_TYPE = 0x00,
@@ -128,10 +177,13 @@ public:
     void deactivateModuleRx(void);
     /**
      * @brief Reset the module via reset pin. Do this only if software reset
-     *        doesn't work.
+     *        doesn't work. It waits for module to start, and if a higher
+     *        speed was negotiated with @ref negotiateBaud , it negotiates it
+     *        again. Virtual, so that resets started from here, like the one
+     *        in @ref negotiateBaud , also reset state of derived backends.
      * 
      */
-    void hardResetModule(void);
+    virtual void hardResetModule(void);
 
     /**
      * @brief Initialise pins to initial values and put module to known state.
@@ -143,7 +195,9 @@ public:
      * @brief Send a command that doesn't need to receive any data.
      * 
      * @param cmd Command string that you want to send.
-     * @param timeout How long to wait for module response in milliseconds.
+     * @param timeout How long to wait for module response in milliseconds. It
+     *                bounds the whole call, including waiting for queued
+     *                commands to complete.
      * @param response Optional buffer to store module response, make sure it is
      *                 of sufficient size!
      * @return AtProcess::Status Returns SUCCESS if response was received and no
@@ -201,7 +255,8 @@ public:
      * @return AtProcess::Status Returns SUCCESS if response was received and no
      *                           error was reported by module.
      *                           Returns TIMEOUT if no command was received in
-     *                           specified time.
+     *                           specified time, or if an earlier command is
+     *                           still in flight.
      *                           Returns GEN_ERROR if module reported and error.
      */
     AtProcess::Status sendReceiveCmd(const char *cmd,
@@ -211,13 +266,147 @@ public:
                                     uint32_t timeout = 3000,
                                     char *response = NULL);
 
+    /**
+     * @brief Start a command without waiting for its response, so the caller
+     *        can do other work while module processes it. Progress is checked
+     *        with @ref pollCmd . Buffers passed to this function must stay
+     *        valid until the command completes.
+     *
+     * @param cmd Command string that you want to send.
+     * @param buff Read buffer or write data depending on readNWrite parameter. Set
+     *             to NULL if neither is needed.
+     * @param size Size of the buffer or data length, depending on readNWrite parameter.
+     * @param readNWrite Boolean which tells if data should be read or written.
+     * @param timeout How long to wait for module response in milliseconds.
+     * @param response Optional buffer to store module response, make sure it is
+     *                 of sufficient size!
+     * @return true If command was sent.
+     * @return false If another command is still in flight or sending failed.
+     */
+    bool startCmd(const char *cmd,
+                  uint8_t *buff = NULL,
+                  uint32_t size = 0,
+                  bool readNWrite = false,
+                  uint32_t timeout = 3000,
+                  char *response = NULL);
+
+    /**
+     * @brief Check the progress of a command started with @ref startCmd ,
+     *        without blocking.
+     *
+     * @return AtProcess::Status Returns IN_PROGRESS while command is still
+     *                           being processed, otherwise same as
+     *                           @ref sendReceiveCmd .
+     */
+    AtProcess::Status pollCmd(void);
+
+    /**
+     * @brief Configure command pipelining used by @ref queueCmd . Module
+     *        buffers received bytes while it processes a command, so several
+     *        commands can be sent back to back without waiting for each
+     *        response. Depth of 1 means stop and wait.
+     *
+     * @param depth Maximum number of commands in flight, up to
+     *              AT_PIPELINE_MAX_DEPTH.
+     * @param maxInFlightBytes Maximum number of bytes sent for commands still
+     *                         in flight. It should not exceed what module can
+     *                         buffer. Single command is always allowed, even
+     *                         if it is larger.
+     */
+    void setPipeline(uint8_t depth, uint32_t maxInFlightBytes);
+
+    /**
+     * @brief Set handler which is called while library waits for the module,
+     *        so application can do some work in the meantime.
+     *
+     * @param handler Handler function or NULL.
+     * @param context Context pointer passed to handler.
+     */
+    void setIdleHandler(IdleHandler *handler, void *context);
+
+    /**
+     * @brief Set the maximum time between two received characters of a module
+     *        response. It only shortens the timeout of each call.
+     *
+     * @param gap Gap timeout in milliseconds, or 0 to disable it.
+     */
+    void setGapTimeout(uint32_t gap);
+
+    /**
+     * @brief Set handler which is called with the status of each command sent
+     *        with @ref queueCmd when its response completes.
+     *
+     * @param handler Handler function or NULL.
+     * @param context Context pointer passed to handler.
+     */
+    void setCmdDoneHandler(AtProcess::DoneHandler *handler, void *context);
+
+    /**
+     * @brief Send a command without waiting for the responses of commands that
+     *        are already in flight. If pipeline is full, it blocks until the
+     *        oldest command completes. Command response is not stored, only its
+     *        status is reported, see @ref setCmdDoneHandler .
+     *
+     * @param cmd Command string that you want to send.
+     * @param data Optional data that is written after the command.
+     * @param dataSize Length of data.
+     * @param timeout How long to wait for room in the pipeline, and for module
+     *                response, in milliseconds.
+     * @return int8_t Ticket of the command, passed later to done handler, or
+     *                negative number if command couldn't be sent.
+     */
+    int8_t queueCmd(const char *cmd,
+                    const uint8_t *data = NULL,
+                    uint32_t dataSize = 0,
+                    uint32_t timeout = 3000);
+
+    /**
+     * @brief Process responses of queued commands without blocking.
+     *
+     * @return AtProcess::Status IN_PROGRESS while some commands are still in
+     *                           flight, otherwise combined status of queued
+     *                           commands, as returned by @ref flushQueue .
+     */
+    AtProcess::Status pollQueue(void);
+
+    /**
+     * @brief Wait until all queued commands complete.
+     *
+     * @param timeout Maximum time to wait in milliseconds.
+     * @return AtProcess::Status Returns SUCCESS if all commands queued since
+     *                           last flush succeeded, otherwise status of the
+     *                           first one that failed. Returns TIMEOUT if
+     *                           commands are still in flight after timeout.
+     */
+    AtProcess::Status flushQueue(uint32_t timeout = 3000);
+
     /**
      * @brief Restart Simple BLE module via builtin command.
      * 
      * @return true If module successfuly restarted.
      * @return false If and error occured during module restart.
      */
-    bool softRestart(void);
+    virtual bool softRestart(void);
+
+    /**
+     * @brief Switch module and host UART to the highest speed up to
+     *        targetBaud that both support. Every candidate speed is set with
+     *        AT+SETBAUD, applied by toggling RX enable pin and checked with AT
+     *        command. If module stops responding it is reset back to
+     *        SIMPLEBLE_DEFAULT_BAUD until the next restart. Speed is
+     *        negotiated again after @ref softRestart and
+     *        @ref hardResetModule , because module always starts at default
+     *        speed.
+     *
+     * @param targetBaud Highest wanted speed, or 0 for default speed.
+     * @return uint32_t Speed in use after negotiation.
+     */
+    uint32_t negotiateBaud(uint32_t targetBaud);
+
+    /**
+     * @brief Current UART speed of the host and the module.
+     */
+    inline uint32_t baud(void) { return hostBaud; }
 
     /**
      * @brief Start advertising with previously constructed payload with setAdvPayload
@@ -293,6 +482,17 @@ public:
      */
     int8_t addChar(uint8_t serviceIndex, uint32_t maxSize, CharPropFlags flags);
 
+    /**
+     * @brief Prepare a handle for frequent access to a characteristic, so its
+     *        address doesn't have to be formatted on each read or write.
+     *
+     * @param serviceIndex Service under which is your desired characteristic.
+     * @param charIndex Desired characteristic index.
+     * @param handle Handle to fill in.
+     * @return true If handle is ready to use.
+     */
+    bool makeCharHandle(uint8_t serviceIndex, uint8_t charIndex, CharHandle *handle);
+
     /**
      * @brief Check if characteristic has any new unread data.
      * 
@@ -308,13 +508,17 @@ public:
      * 
      * @param serviceIndex Service under which is your desired characteristic.
      * @param charIndex Desired characteristic index.
-     * @param buff Buffer in which to save characteristic data.
+     * @param buff Buffer in which to save characteristic data. If NULL only
+     *             the size is read, like with @ref checkChar .
      * @param buffSize Buffer size.
-     * @return int32_t Positive number if characteristic has some new data to read.
-     *                 Negative if characteristic has no new data to read.
+     * @return int32_t With buffer, size of characteristic data, even if only
+     *                 buffSize bytes were stored, or -1 on error. Without
+     *                 buffer, positive number if characteristic has some new
+     *                 data to read, negative if it has no new data to read.
      */
     int32_t readChar(uint8_t serviceIndex, uint8_t charIndex,
                       uint8_t *buff, uint32_t buffSize);
+    int32_t readChar(const CharHandle &handle, uint8_t *buff, uint32_t buffSize);
 
     /**
      * @brief Write data to a characteristic.
@@ -328,17 +532,63 @@ public:
      */
     bool writeChar(uint8_t serviceIndex, uint8_t charIndex,
                    const uint8_t *data, uint32_t dataSize);
+    bool writeChar(const CharHandle &handle, const uint8_t *data, uint32_t dataSize);
 
+    /**
+     * @brief Write data to a characteristic through command pipeline, see
+     *        @ref queueCmd .
+     *
+     * @param serviceIndex Service under which is your desired characteristic.
+     * @param charIndex Desired characteristic index.
+     * @param data Buffer with data that should be transfered to desired characteristic.
+     * @param dataSize Data length in buffer.
+     * @return int8_t Ticket of the write command, or negative number if it
+     *                couldn't be sent.
+     */
+    int8_t writeCharQueued(uint8_t serviceIndex, uint8_t charIndex,
+                           const uint8_t *data, uint32_t dataSize);
+    int8_t writeCharQueued(const CharHandle &handle,
+                           const uint8_t *data, uint32_t dataSize);
+
+    /**
+     * @brief Get the next characteristic update written by the client. Updates
+     *        are collected from URCs whenever module input is processed, also
+     *        while other commands are executed, and several updates of the
+     *        same characteristic are merged into one.
+     *
+     * @param serviceIndex Service of the updated characteristic.
+     * @param charIndex Index of the updated characteristic.
+     * @param dataSize Size of the new characteristic data.
+     * @param timeout Time in milliseconds to wait if no update is queued.
+     * @return true If an update was received.
+     * @return false If there was no update before timeout.
+     */
     bool waitCharUpdate(uint8_t* serviceIndex, uint8_t* charIndex,
                         uint32_t* dataSize, uint32_t timeout=1000);
 
+    /**
+     * @brief Number of characteristic updates dropped because update queue was
+     *        full, see SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN .
+     */
+    inline uint32_t lostCharUpdates(void) { return charUpdatesLost; }
+
+    /**
+     * @brief Check whether an update of characteristic is waiting for
+     *        @ref waitCharUpdate , after processing module input received so
+     *        far. It doesn't block and doesn't remove the update.
+     *
+     * @param serviceIndex Service of the characteristic.
+     * @param charIndex Index of the characteristic.
+     * @return true If characteristic was written by the client.
+     */
+    bool charUpdatePending(uint8_t serviceIndex, uint8_t charIndex);
+
     const SimpleBLEBackendInterface *ifc;
 
     AtProcess at;
 
-private:
-
-    char unprocessedUrc[25];
+protected:
+    // Shared with backends that carry characteristic traffic differently.
 
     inline void internalDebug(const char *dbgPrint)
     {
@@ -348,10 +598,83 @@ private:
         }
     }
 
-    uint32_t utilityItoa(int32_t value, char *strBuff, uint32_t strBuffSize);
-    int32_t utilityAtoi(const char* asciiInt);
+    /**
+     * @brief Complete the last module RX block with filler, see
+     *        SIMPLEBLE_RX_BLOCK_FILL .
+     *
+     * @param sentBytes Bytes sent for the command so far.
+     * @return uint32_t Number of filler bytes sent.
+     */
+    uint32_t fillRxBlock(uint32_t sentBytes);
+
+    void queueCharUpdate(uint8_t serviceIndex, uint8_t charIndex, uint32_t dataSize);
+
+private:
+
+    /**
+     * @brief Known URC and response prefixes, in the order they are
+     *        registered with AtProcess.
+     */
+    enum UrcType
+    {
+        URC_UNKNOWN = -1,
+        URC_START,
+        URC_CHARWRITE,
+        URC_ADDSRV,
+        URC_ADDCHAR,
+        URC_READCHAR
+    };
+
+    static const AtUrcEntry urcTable[];
+
+    /**
+     * @brief Characteristic update received in ^CHARWRITE URC.
+     */
+    struct CharUpdate
+    {
+        uint8_t serviceIndex;
+        uint8_t charIndex;
+        uint32_t dataSize;
+    };
+
+    uint32_t hostBaud;
+    uint32_t targetBaud;
+
+    uint8_t pipelineDepth;
+    uint32_t pipelineMaxBytes;
+    AtProcess::Status queueStatus;
+    AtProcess::DoneHandler *cmdDoneHandler;
+    void *cmdDoneContext;
+
+    CharUpdate charUpdates[SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN];
+    uint8_t charUpdatesHead;
+    uint8_t charUpdatesLen;
+    uint32_t charUpdatesLost;
+
+    void resetHostBaud(void);
+
+    uint32_t rxBlockFillLen(uint32_t sentBytes);
+    uint32_t writeRxFill(uint32_t fillLen);
+
+    static char *utilityUtoa(uint32_t value, char *str);
+    static uint32_t utilityItoa(int32_t value, char *strBuff, uint32_t strBuffSize);
+
+    static void charWriteUrc(const LineView &line, int8_t urc, void *context);
+
+    uint8_t buildCharCmd(char *cmdStr, const char *cmd, const CharHandle &handle,
+                         uint32_t lastArg);
+    AtProcess::Status flushQueueUntil(Deadline &deadline);
+    bool prepareCmd(const char *cmd,
+                    uint8_t *buff,
+                    uint32_t size,
+                    bool readNWrite,
+                    uint32_t timeout,
+                    char *response);
+    AtProcess::Status sendReceiveCharCmd(char *cmdStr, uint8_t cmdLen,
+                                         uint8_t *buff, uint32_t size,
+                                         bool readNWrite);
 
-    const char *findCmdReturnStatus(const char *cmdRet, const char *statStart);
+    bool parseResponse(const AtLineSchema *schema, int32_t *fields);
     void debugPrint(const char *str);
 
 };
@@ -4,19 +4,13 @@
 #include <stdint.h>
 
 
-Timeout::Timeout(uint32_t timeout) : timeout(timeout)
+Timeout::Timeout(MillisType *millisF, uint32_t timeout) :
+    millisF(millisF),
+    timeout(timeout)
 {
     restart();
 }
 
-MillisType *Timeout::_millis = NULL;
-
-void Timeout::init(MillisType *millisF)
-{
-    if( millisF )
-        _millis = millisF;
-}
-
 int32_t Timeout::remaining(void)
 {
     uint32_t passedTime = passed();
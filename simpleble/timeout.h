@@ -18,24 +18,14 @@ class Timeout
 public:
 
     /**
-     * @brief Construct a new Timeout object. It checks a static member for
-     *        milliseconds counter function.
+     * @brief Construct a new Timeout object.
      * 
+     * @param millisF Arduino like milliseconds counter of the clock this
+     *                timeout runs on. Each instance keeps its own, so objects
+     *                driven by different clocks don't interfere.
      * @param timeout Timeout to check for in milliseconds.
      */
-    Timeout(uint32_t timeout);
-
-    // Call this before any other calls.
-    /**
-     * @brief Static initializer for any instance of this class. It takes
-     *        a milliseconds counter function as an argument, which serves for
-     *        checking if timeout passed.
-     * 
-     * @param millisF Arduino like milliseconds counter. If NULL internal pointer
-     *                won't be updated.
-     * @return MillisecondC* Returns internal millis pointer value.
-     */
-    static void init(MillisType *millisF);
+    Timeout(MillisType *millisF, uint32_t timeout);
 
     /**
      * @brief Restarts the timeout counter.
@@ -89,14 +79,113 @@ private:
      */
     inline uint32_t privMillis(void)
     {
-        return *_millis ? (*_millis)() : 0 ;
+        return millisF ? millisF() : 0 ;
     }
 
-    static MillisType *_millis;
+    MillisType *millisF;
 
     uint32_t startTime;
     uint32_t timeout;
 };
 
 
+/**
+ * @brief Absolute deadline of a whole blocking call, with an optional gap
+ *        timeout between received bytes. Received bytes restart only the gap,
+ *        so input that keeps dribbling in can't extend the call past its
+ *        total time. Both times are checked as intervals from their start, so
+ *        millis() wraparound doesn't affect them.
+ */
+class Deadline
+{
+public:
+
+    /**
+     * @brief Construct a new Deadline object, counting from now.
+     * 
+     * @param millisF Milliseconds counter of the clock to use.
+     * @param total Maximum time of the whole call in milliseconds.
+     * @param gap Maximum time between two received bytes in milliseconds, or
+     *            0 if it isn't limited.
+     */
+    Deadline(MillisType *millisF, uint32_t total, uint32_t gap = 0) :
+        total(millisF, total),
+        gap(millisF, gap),
+        gapTimeout(gap)
+    {}
+
+    /**
+     * @brief Start counting both times again from now.
+     */
+    inline void restart(void)
+    {
+        total.restart();
+        gap.restart();
+    }
+    inline void restart(uint32_t newTotal, uint32_t newGap = 0)
+    {
+        gapTimeout = newGap;
+        total.restart(newTotal);
+        gap.restart(newGap);
+    }
+
+    /**
+     * @brief Note that a byte was received, restarting the gap timeout.
+     */
+    inline void touch(void)
+    {
+        if( gapTimeout )
+        {
+            gap.restart();
+        }
+    }
+
+    /**
+     * @brief Checks if total time or gap between bytes expired.
+     */
+    inline bool expired(void)
+    {
+        return total.expired() || (gapTimeout && gap.expired());
+    }
+
+    /**
+     * @brief Get the time until deadline expires. If it expired return with
+     *        minus sign.
+     * 
+     * @return int32_t remaining time(positive) or overrun time(negative)
+     */
+    inline int32_t remaining(void)
+    {
+        int32_t retval = total.remaining();
+
+        if( gapTimeout )
+        {
+            int32_t gapRemaining = gap.remaining();
+            retval = gapRemaining < retval ? gapRemaining : retval ;
+        }
+
+        return retval;
+    }
+
+    /**
+     * @brief Remaining time that can be passed on as a timeout to a nested
+     *        call, so it expires together with this deadline.
+     * 
+     * @return uint32_t remaining time, or 0 if deadline expired.
+     */
+    inline uint32_t left(void)
+    {
+        int32_t retval = remaining();
+
+        return retval > 0 ? retval : 0 ;
+    }
+
+private:
+
+    Timeout total;
+    Timeout gap;
+    uint32_t gapTimeout;
+};
+
+
 #endif//__TIMEOUT_H__
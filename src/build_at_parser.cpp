@@ -0,0 +1 @@
+#include "../simpleble/at_parser.cpp"
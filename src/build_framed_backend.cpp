@@ -0,0 +1 @@
+#include "../simpleble/framed_backend.cpp"
@@ -39,13 +39,11 @@ int exampleChar = -1;
 int exampleService2 = -1;
 int exampleChar2 = -1;
 
-static Timeout secondTimeout(10000);
+static Timeout secondTimeout(millis, 10000);
 
 
 void setup()
 {
-    Timeout::init(millis);
-
     pinMode(RX_ENABLE_PIN, OUTPUT);
     pinMode(MODULE_RESET_PIN, OUTPUT);
 
@@ -0,0 +1,384 @@
+#include "esp32_backend.h"
+#include "simple_ble.h"
+#include "timeout.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+
+/*
+ * Checks order, latency and overflow of characteristic updates that BLE
+ * callbacks queue for Esp32Backend::waitCharUpdate , and tank options of
+ * SimpleBLE on top of it. BLE classes and FreeRTOS are replaced by host
+ * stubs, and a second thread plays the BLE stack task. Build with -DESP32, so
+ * the backend is compiled:
+ *
+ *   g++ -std=gnu++11 -DESP32 -pthread -Isimpleble -Itests/host/esp32_stubs \
+ *       simpleble/esp32_backend.cpp simpleble/simple_ble.cpp \
+ *       simpleble/timeout.cpp tests/host/esp32_events.cpp
+ *
+ * Add -fsanitize=thread to check the queue for data races.
+ */
+
+
+#define STRESS_UPDATES                                              (100000)
+// Characteristics that share a flag word in the flags stress test.
+#define STRESS_CHARS                                                (8)
+#define FIFO_STRESS_WRITES                                          (2000)
+
+
+typedef std::chrono::steady_clock HostClock;
+
+static const HostClock::time_point startTime = HostClock::now();
+
+static uint32_t hostMillis(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        HostClock::now() - startTime).count();
+}
+
+static void hostDelay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+static const Esp32BackendInterface hostIfc = { hostMillis, hostDelay, NULL };
+
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    printf("%s %s\n", condition ? "pass" : "FAIL", what);
+
+    if( !condition )
+    {
+        failures++;
+    }
+}
+
+static BLECharacteristic *characteristic(Esp32Backend &backend,
+                                         uint8_t serviceIndex, uint8_t charIndex)
+{
+    Esp32Backend::CharHandle handle;
+    backend.makeCharHandle(serviceIndex, charIndex, &handle);
+
+    return handle.characteristic;
+}
+
+static void clientWrite(Esp32Backend &backend, uint8_t charIndex, uint32_t len,
+                        uint8_t serviceIndex = 0)
+{
+    static const uint8_t data[64] = { 0 };
+
+    characteristic(backend, serviceIndex, charIndex)->clientWrite(data, len);
+}
+
+// Writes a value whose size and first byte both tell which write it was.
+static void clientWriteSeq(Esp32Backend &backend, uint8_t serviceIndex, uint8_t charIndex,
+                           uint8_t seq)
+{
+    uint8_t data[4] = { seq, seq, seq, seq };
+
+    characteristic(backend, serviceIndex, charIndex)->clientWrite(data, 1 + seq % 4);
+}
+
+static bool readSeq(Esp32Backend &backend, uint8_t serviceIndex, uint8_t charIndex,
+                    uint8_t seq)
+{
+    uint8_t buff[4] = { 0 };
+
+    return backend.readChar(serviceIndex, charIndex, buff, sizeof(buff)) == 1 + seq % 4 &&
+           buff[0] == seq;
+}
+
+static uint32_t tankNotifications(SimpleBLE &ble, SimpleBLE::TankId tank)
+{
+    Esp32Backend::CharHandle handle;
+    ble.backend.makeCharHandle(ble.tanksServiceIndex, tank, &handle);
+
+    return handle.characteristic->notifications;
+}
+
+static void checkTanks(void)
+{
+    static SimpleBLE ble(&hostIfc);
+
+    check(ble.begin(), "SimpleBLE begin");
+
+    // Staged value goes out once, a flush without new values sends nothing.
+    SimpleBLE::TankId staged = ble.addTank(SimpleBLE::READ, 4, SimpleBLE::TANK_LATEST_VALUE);
+    ble.writeTank(staged, "1");
+    ble.writeTank(staged, "2");
+    bool firstFlush = ble.flushTanks() && tankNotifications(ble, staged) == 1;
+    check(firstFlush && ble.flushTanks() && tankNotifications(ble, staged) == 1,
+          "second flush sends nothing");
+
+    // Same value is written once, and reads are served from the shadow.
+    SimpleBLE::TankId shadowed = ble.addTank(SimpleBLE::READ, 4, SimpleBLE::TANK_SHADOW);
+    uint8_t buff[4];
+    uint32_t readLen;
+    check(ble.writeTank(shadowed, "ab") && ble.writeTank(shadowed, "ab") &&
+          tankNotifications(ble, shadowed) == 1, "same value written once");
+
+    Esp32Backend::CharHandle handle;
+    ble.backend.makeCharHandle(ble.tanksServiceIndex, shadowed, &handle);
+    // Changed behind the library's back, so only a shadow hit returns "ab".
+    handle.characteristic->setValue((uint8_t*)"xy", 2);
+    check(ble.readTank(shadowed, buff, sizeof(buff), &readLen) &&
+          readLen == 2 && !memcmp(buff, "ab", 2), "read served from shadow");
+
+    handle.characteristic->clientWrite((const uint8_t*)"cd", 2);
+    check(ble.readTank(shadowed, buff, sizeof(buff), &readLen) &&
+          readLen == 2 && !memcmp(buff, "cd", 2), "client write invalidates shadow");
+}
+
+
+int main(void)
+{
+    static Esp32Backend backend(&hostIfc);
+    uint8_t serviceIndex, charIndex;
+    uint32_t dataSize;
+
+    backend.begin();
+    check(backend.addService(0xA0) == 0 &&
+          backend.addChar(0, 20, Esp32Backend::WRITE) == 0 &&
+          backend.addChar(0, 20, Esp32Backend::WRITE) == 1 &&
+          backend.addChar(0, 20, Esp32Backend::WRITE) == 2 &&
+          backend.addService(0xA1) == 1 &&
+          backend.addChar(1, 20, Esp32Backend::READ_AND_NOTIFY) == 0, "addChar");
+
+    Esp32Backend::CharHandle notifyHandle;
+    check(backend.makeCharHandle(1, 0, &notifyHandle) && notifyHandle.notify &&
+          backend.writeChar(notifyHandle, (const uint8_t*)"ab", 2) &&
+          notifyHandle.characteristic->notifications == 1 &&
+          !backend.makeCharHandle(1, 1, &notifyHandle), "characteristic table");
+
+    // Handles are reserved for the planned characteristics, with descriptors.
+    bool sized = backend.addService(0xA2, 3) == 2;
+    for(uint8_t i = 0; i < 3; i++)
+    {
+        sized &= backend.addChar(2, 20, Esp32Backend::READ_AND_NOTIFY) == i;
+    }
+    check(sized && backend.addChar(2, 20, Esp32Backend::WRITE) < 0 &&
+          backend.services[2].serv->numHandles >= 1 + 3*3 &&
+          backend.services[0].serv->numHandles >= 1 + 3*Esp32Backend::MAX_NUM_CHARS,
+          "service handles sized");
+
+    uint8_t pendingService = 0;
+    clientWrite(backend, 1, 4, 2);
+    clientWrite(backend, 2, 4, 2);
+    check(backend.findPendingChar(&pendingService, &charIndex) &&
+          pendingService == 2 && charIndex == 1, "pending characteristic found");
+    uint8_t buff[4];
+    backend.readChar(2, 1, buff, sizeof(buff));
+    backend.readChar(2, 2, buff, sizeof(buff));
+    pendingService = 0;
+    check(!backend.findPendingChar(&pendingService, &charIndex), "no pending characteristic");
+    while( backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 0) )
+    {
+        // Drop updates of the writes above.
+    }
+
+    clientWrite(backend, 2, 3);
+    clientWrite(backend, 0, 5, 1);
+    clientWrite(backend, 2, 7);
+    bool inOrder = true;
+    const uint8_t expectedServices[] = { 0, 1, 0 };
+    const uint8_t expectedChars[] = { 2, 0, 2 };
+    const uint32_t expectedSizes[] = { 3, 5, 7 };
+    for(uint8_t i = 0; i < 3; i++)
+    {
+        inOrder &= backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 0) &&
+                   serviceIndex == expectedServices[i] && charIndex == expectedChars[i] &&
+                   dataSize == expectedSizes[i];
+    }
+    check(inOrder, "updates in write order");
+
+    uint32_t waitStart = hostMillis();
+    check(!backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 50) &&
+          hostMillis() - waitStart >= 50 && hostMillis() - waitStart < 100,
+          "timeout without updates");
+
+    // Waiting task wakes up as soon as callback queues the update.
+    uint32_t worstWakeUs = 0;
+    bool woken = true;
+    for(uint8_t i = 0; i < 20; i++)
+    {
+        HostClock::time_point writeTime;
+        std::thread bleTask([&]
+        {
+            hostDelay(5);
+            writeTime = HostClock::now();
+            clientWrite(backend, 1, i + 1);
+        });
+
+        woken &= backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 1000) &&
+                 charIndex == 1 && dataSize == (uint32_t)i + 1;
+        uint32_t wakeUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            HostClock::now() - writeTime).count();
+        worstWakeUs = wakeUs > worstWakeUs ? wakeUs : worstWakeUs;
+
+        bleTask.join();
+    }
+    printf("worst wake up %u us\n", worstWakeUs);
+    check(woken && worstWakeUs < 20000, "waiting task woken by update");
+
+    for(uint32_t i = 0; i < SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN + 3; i++)
+    {
+        clientWrite(backend, 0, 1);
+    }
+    uint32_t queued = 0;
+    while( backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 0) )
+    {
+        queued++;
+    }
+    check(queued == SIMPLEBLE_CHAR_UPDATE_QUEUE_LEN && backend.lostCharUpdates() == 3,
+          "overflow counted as lost");
+
+    // Producer and consumer race, every update arrives once and in order.
+    uint32_t lostBefore = backend.lostCharUpdates();
+    std::thread bleTask([&]
+    {
+        for(uint32_t i = 1; i <= STRESS_UPDATES; i++)
+        {
+            backend.pushCharUpdate(0, i % 3, i);
+
+            // Writes come from the radio, a bit apart.
+            std::this_thread::yield();
+        }
+    });
+
+    uint32_t received = 0;
+    uint32_t lastSize = 0;
+    bool ordered = true;
+    while( backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 200) )
+    {
+        ordered &= dataSize > lastSize && charIndex == dataSize % 3;
+        lastSize = dataSize;
+        received++;
+    }
+    bleTask.join();
+
+    uint32_t lost = backend.lostCharUpdates() - lostBefore;
+    printf("stress received %u, lost %u\n", received, lost);
+    check(ordered && received + lost == STRESS_UPDATES, "concurrent updates");
+
+    // Client writes faster than they are read are queued, with each policy.
+    check(backend.addService(0xA3, 4) == 3 &&
+          backend.addChar(3, 4, Esp32Backend::WRITE) == 0 &&
+          backend.addChar(3, 4, Esp32Backend::WRITE) == 1 &&
+          backend.addChar(3, 4, Esp32Backend::WRITE) == 2 &&
+          backend.addChar(3, 4, Esp32Backend::WRITE) == 3 &&
+          backend.addCharFifo(3, 0, 4, 3, Esp32Backend::FIFO_DROP_OLDEST) &&
+          backend.addCharFifo(3, 1, 4, 2, Esp32Backend::FIFO_DROP_NEWEST) &&
+          backend.addCharFifo(3, 2, 4, 2, Esp32Backend::FIFO_BACKPRESSURE) &&
+          !backend.addCharFifo(3, 2, 4, 2, Esp32Backend::FIFO_DROP_OLDEST) &&
+          !backend.addCharFifo(3, 3, 4, 200, Esp32Backend::FIFO_DROP_OLDEST),
+          "addCharFifo");
+
+    for(uint8_t seq = 1; seq <= 5; seq++)
+    {
+        clientWriteSeq(backend, 3, 0, seq);
+        clientWriteSeq(backend, 3, 1, seq);
+    }
+    // Too large for the queue, queued values stay.
+    static const uint8_t tooLarge[5] = { 0 };
+    characteristic(backend, 3, 0)->clientWrite(tooLarge, sizeof(tooLarge));
+    check(backend.charFifoOverflows(3, 0) == 3, "oversized write dropped once");
+
+    check(backend.readChar(3, 0, NULL, 0) == 1 + 3 % 4 &&
+          readSeq(backend, 3, 0, 3) && readSeq(backend, 3, 0, 4) &&
+          backend.charUpdatePending(3, 0) && readSeq(backend, 3, 0, 5) &&
+          !backend.charUpdatePending(3, 0) &&
+          backend.readChar(3, 0, buff, sizeof(buff)) < 0 &&
+          backend.charFifoOverflows(3, 0) == 3, "FIFO drops oldest");
+    check(readSeq(backend, 3, 1, 1) && readSeq(backend, 3, 1, 2) &&
+          backend.readChar(3, 1, buff, sizeof(buff)) < 0 &&
+          backend.charFifoOverflows(3, 1) == 3, "FIFO drops newest");
+
+    uint32_t fifoUpdates = 0;
+    while( backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 0) )
+    {
+        fifoUpdates++;
+    }
+    check(fifoUpdates == 5 + 2, "update for every queued write");
+
+    // Writer is held back until reader makes room, nothing is dropped.
+    std::thread clientTask([&]
+    {
+        for(uint32_t i = 0; i < FIFO_STRESS_WRITES; i++)
+        {
+            clientWriteSeq(backend, 3, 2, (uint8_t)i);
+        }
+    });
+
+    bool fifoOrdered = true;
+    for(uint32_t i = 0; i < FIFO_STRESS_WRITES; i++)
+    {
+        Timeout readTimeout(hostMillis, 1000);
+        bool read = false;
+
+        while( !read && readTimeout.notExpired() )
+        {
+            if( backend.waitCharUpdate(&serviceIndex, &charIndex, &dataSize, 100) )
+            {
+                fifoOrdered &= serviceIndex == 3 && charIndex == 2;
+                read = readSeq(backend, 3, 2, (uint8_t)i);
+            }
+        }
+        fifoOrdered &= read;
+    }
+    clientTask.join();
+    check(fifoOrdered && backend.charFifoOverflows(3, 2) == 0, "FIFO backpressure");
+
+    // Callbacks set flags of a word while another task clears other flags of
+    // it. Last write of every characteristic must still be seen.
+    static std::atomic<uint32_t> written[STRESS_CHARS];
+    std::atomic<bool> writerDone(false);
+    uint32_t seen[STRESS_CHARS] = { 0 };
+    Esp32Backend::UpdatedDataFlags &flags = backend.receivedData[0];
+    flags.clear();
+    std::thread writerTask([&]
+    {
+        for(uint32_t i = 1; i <= STRESS_UPDATES; i++)
+        {
+            written[i % STRESS_CHARS].store(i, std::memory_order_relaxed);
+            flags.setFlag(i % STRESS_CHARS);
+        }
+        writerDone = true;
+    });
+
+    auto consume = [&]
+    {
+        for(uint8_t c = 0; c < STRESS_CHARS; c++)
+        {
+            if( flags.testAndClear(c) )
+            {
+                seen[c] = written[c].load(std::memory_order_relaxed);
+            }
+        }
+    };
+    while( !writerDone )
+    {
+        consume();
+    }
+    writerTask.join();
+    // Picks up what was written after the last pass.
+    consume();
+
+    bool allSeen = flags.findFlag() < 0;
+    for(uint8_t c = 0; c < STRESS_CHARS; c++)
+    {
+        allSeen &= seen[c] == written[c].load() && seen[c] > STRESS_UPDATES - STRESS_CHARS;
+    }
+    check(allSeen, "concurrent flags");
+
+    checkTanks();
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,283 @@
+#ifndef __BLE_STUBS_H__
+#define __BLE_STUBS_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+/*
+ * Minimal host stand-ins for the ESP32 Arduino BLE classes that
+ * esp32_backend.cpp uses, so it can be built and tested on a PC. Nothing goes
+ * over the air: characteristics keep their value in memory, and a test plays
+ * the client with BLECharacteristic::clientWrite , which runs the write
+ * callback like the BLE stack task would.
+ */
+
+
+typedef int esp_power_level_t;
+enum
+{
+    ESP_PWR_LVL_N12, ESP_PWR_LVL_N9, ESP_PWR_LVL_N6, ESP_PWR_LVL_N3,
+    ESP_PWR_LVL_N0, ESP_PWR_LVL_P3, ESP_PWR_LVL_P6, ESP_PWR_LVL_P9
+};
+
+typedef uint8_t esp_ble_adv_data_type;
+
+struct esp_ble_gatts_cb_param_t {};
+
+
+class String
+{
+public:
+    String(const char *str, uint32_t len) : str(str, len) {}
+    String(const std::string &str) : str(str) {}
+
+    String operator+(const String &other) const { return String(str + other.str); }
+
+private:
+    std::string str;
+};
+
+
+class BLEUUID
+{
+public:
+    struct Native
+    {
+        uint8_t len;
+        union
+        {
+            uint16_t uuid16;
+            uint8_t uuid128[16];
+        } uuid;
+    };
+
+    BLEUUID() { memset(&native, 0, sizeof(native)); }
+
+    BLEUUID(uint16_t uuid16) : BLEUUID()
+    {
+        native.len = 2;
+        native.uuid.uuid16 = uuid16;
+    }
+
+    // Stored least significant byte first, as ESP-IDF does.
+    BLEUUID(const char *str) : BLEUUID()
+    {
+        uint8_t pos = 16;
+
+        native.len = 16;
+        for(; *str && pos; str++)
+        {
+            if( *str == '-' )
+            {
+                continue;
+            }
+
+            native.uuid.uuid128[--pos] = hex(str[0]) << 4 | hex(str[1]);
+            str++;
+        }
+    }
+
+    Native *getNative(void) { return &native; }
+
+    bool equals(const BLEUUID &other) const
+    {
+        return native.len == other.native.len &&
+               !memcmp(&native.uuid, &other.native.uuid, native.len);
+    }
+
+private:
+    Native native;
+
+    static uint8_t hex(char c)
+    {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    }
+};
+
+
+class BLEDescriptor
+{
+public:
+    BLEDescriptor(BLEUUID uuid) : uuid(uuid) {}
+
+    BLEUUID uuid;
+};
+
+
+class BLECharacteristic;
+
+class BLECharacteristicCallbacks
+{
+public:
+    virtual ~BLECharacteristicCallbacks() {}
+    virtual void onWrite(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param)
+    { (void)pCharacteristic; (void)param; }
+    virtual void onRead(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param)
+    { (void)pCharacteristic; (void)param; }
+};
+
+
+class BLECharacteristic
+{
+public:
+    static const uint32_t PROPERTY_READ = 1 << 0;
+    static const uint32_t PROPERTY_WRITE = 1 << 1;
+    static const uint32_t PROPERTY_NOTIFY = 1 << 2;
+    static const uint32_t PROPERTY_BROADCAST = 1 << 3;
+    static const uint32_t PROPERTY_INDICATE = 1 << 4;
+    static const uint32_t PROPERTY_WRITE_NR = 1 << 5;
+
+    BLECharacteristic(BLEUUID uuid, uint32_t properties) :
+        notifications(0), uuid(uuid), properties(properties), callbacks(NULL) {}
+
+    BLEUUID getUUID(void) { return uuid; }
+    void setCallbacks(BLECharacteristicCallbacks *pCallbacks) { callbacks = pCallbacks; }
+    void addDescriptor(BLEDescriptor *pDescriptor) { descriptors.push_back(pDescriptor); }
+
+    BLEDescriptor *getDescriptorByUUID(BLEUUID descUuid)
+    {
+        for(size_t i = 0; i < descriptors.size(); i++)
+        {
+            if( descriptors[i]->uuid.equals(descUuid) )
+            {
+                return descriptors[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    uint8_t *getData(void) { return value.empty() ? NULL : &value[0]; }
+    size_t getLength(void) { return value.size(); }
+    void setValue(uint8_t *data, size_t len) { value.assign(data, data + len); }
+    void notify(void) { notifications++; }
+
+    /**
+     * @brief Write from the client side. Run it on its own thread to play the
+     *        BLE stack task.
+     */
+    void clientWrite(const uint8_t *data, size_t len)
+    {
+        value.assign(data, data + len);
+
+        if( callbacks )
+        {
+            callbacks->onWrite(this, NULL);
+        }
+    }
+
+    uint32_t notifications;
+
+private:
+    BLEUUID uuid;
+    uint32_t properties;
+    BLECharacteristicCallbacks *callbacks;
+    std::vector<BLEDescriptor*> descriptors;
+    std::vector<uint8_t> value;
+};
+
+
+class BLEService
+{
+public:
+    BLEService(BLEUUID uuid, uint32_t numHandles) : numHandles(numHandles), uuid(uuid) {}
+
+    BLEUUID getUUID(void) { return uuid; }
+    void start(void) {}
+
+    BLECharacteristic *createCharacteristic(BLEUUID charUuid, uint32_t properties)
+    {
+        characteristics.push_back(new BLECharacteristic(charUuid, properties));
+
+        return characteristics.back();
+    }
+
+    BLECharacteristic *getCharacteristic(BLEUUID charUuid)
+    {
+        for(size_t i = 0; i < characteristics.size(); i++)
+        {
+            if( characteristics[i]->getUUID().equals(charUuid) )
+            {
+                return characteristics[i];
+            }
+        }
+
+        return nullptr;
+    }
+
+    uint32_t numHandles;
+
+private:
+    BLEUUID uuid;
+    std::vector<BLECharacteristic*> characteristics;
+};
+
+
+class BLEAdvertisementData
+{
+public:
+    void addData(String data) { (void)data; }
+};
+
+
+class BLEAdvertising
+{
+public:
+    void setScanResponse(bool scanResponse) { (void)scanResponse; }
+    void setMinPreferred(uint16_t interval) { (void)interval; }
+    void setMaxPreferred(uint16_t interval) { (void)interval; }
+    void setMinInterval(uint16_t interval) { (void)interval; }
+    void setMaxInterval(uint16_t interval) { (void)interval; }
+    void setAdvertisementData(BLEAdvertisementData &data) { (void)data; }
+    void start(void) {}
+    void stop(void) {}
+};
+
+
+class BLEServer;
+
+class BLEServerCallbacks
+{
+public:
+    virtual ~BLEServerCallbacks() {}
+    virtual void onConnect(BLEServer *pServer) { (void)pServer; }
+    virtual void onDisconnect(BLEServer *pServer) { (void)pServer; }
+};
+
+
+class BLEServer
+{
+public:
+    void setCallbacks(BLEServerCallbacks *pCallbacks) { (void)pCallbacks; }
+    BLEService *createService(BLEUUID uuid, uint32_t numHandles=15, uint8_t inst_id=0)
+    {
+        (void)inst_id;
+
+        return new BLEService(uuid, numHandles);
+    }
+    BLEAdvertising *getAdvertising(void);
+};
+
+
+class BLEDevice
+{
+public:
+    static void init(const char *name) { (void)name; }
+    static BLEServer *createServer(void) { return new BLEServer(); }
+    static void setPower(esp_power_level_t level) { (void)level; }
+
+    static BLEAdvertising *getAdvertising(void)
+    {
+        static BLEAdvertising advertising;
+
+        return &advertising;
+    }
+};
+
+inline BLEAdvertising *BLEServer::getAdvertising(void) { return BLEDevice::getAdvertising(); }
+
+
+#endif//__BLE_STUBS_H__
@@ -0,0 +1,21 @@
+#ifndef __FREERTOS_STUBS_H__
+#define __FREERTOS_STUBS_H__
+
+#include <stdint.h>
+
+
+/*
+ * Host stand-in for the FreeRTOS parts esp32_backend.cpp uses. Ticks are
+ * milliseconds.
+ */
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE                                                      (1)
+#define pdFALSE                                                     (0)
+#define pdMS_TO_TICKS(ms)                                           ((TickType_t)(ms))
+#define portMAX_DELAY                                               ((TickType_t)0xFFFFFFFF)
+
+
+#endif//__FREERTOS_STUBS_H__
@@ -0,0 +1,73 @@
+#ifndef __SEMPHR_STUBS_H__
+#define __SEMPHR_STUBS_H__
+
+#include "FreeRTOS.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+
+/*
+ * Binary semaphore on host threads, given by the BLE callback thread and
+ * taken by the task waiting for updates. Mutexes are the same semaphore.
+ */
+
+struct BinarySemaphore
+{
+    std::mutex lock;
+    std::condition_variable given;
+    bool available;
+};
+
+typedef BinarySemaphore *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    SemaphoreHandle_t sem = new BinarySemaphore();
+    sem->available = false;
+
+    return sem;
+}
+
+// Mutex is a semaphore that starts given, without priority inheritance.
+inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t sem = new BinarySemaphore();
+    sem->available = true;
+
+    return sem;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    std::lock_guard<std::mutex> guard(sem->lock);
+
+    if( sem->available )
+    {
+        return pdFALSE;
+    }
+
+    sem->available = true;
+    sem->given.notify_one();
+
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> guard(sem->lock);
+
+    if( !sem->given.wait_for(guard, std::chrono::milliseconds(ticks),
+                             [sem] { return sem->available; }) )
+    {
+        return pdFALSE;
+    }
+
+    sem->available = false;
+
+    return pdTRUE;
+}
+
+
+#endif//__SEMPHR_STUBS_H__
@@ -0,0 +1,206 @@
+#include "at_parser.h"
+#include "at_process.h"
+#include "simple_ble_backend.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+
+/*
+ * Host microbenchmarks of the parsing and formatting primitives that run on
+ * every byte and every command. Inputs are fixed canned streams, so numbers
+ * only change with the code. Host ns/op don't translate to AVR directly, but
+ * ratios between runs do. Build with the library sources, no simulator is
+ * needed:
+ *
+ *   g++ -std=gnu++11 -O2 -Isimpleble simpleble/at_process.cpp \
+ *       simpleble/at_parser.cpp simpleble/simple_ble_backend.cpp \
+ *       simpleble/timeout.cpp tests/host/micro_bench.cpp
+ *
+ * Output is CSV: name,ops,ns_per_op,bytes_per_op. Bytes are the input parsed
+ * or the command arguments formatted in one operation.
+ */
+
+
+#define BENCH_OPS                                                   (200000)
+
+
+typedef std::chrono::steady_clock BenchClock;
+
+static volatile uint32_t sink;
+
+static const char *stream;
+static uint32_t streamLen;
+static uint32_t streamPos;
+
+static void setStream(const char *str)
+{
+    stream = str;
+    streamLen = strlen(str);
+    streamPos = 0;
+}
+
+static bool streamGet(char *c)
+{
+    if( streamPos >= streamLen )
+    {
+        return false;
+    }
+
+    *c = stream[streamPos++];
+
+    return true;
+}
+
+static uint32_t streamRead(uint8_t *data, uint32_t dataLen)
+{
+    uint32_t left = streamLen - streamPos;
+    dataLen = dataLen < left ? dataLen : left;
+
+    memcpy(data, &stream[streamPos], dataLen);
+    streamPos += dataLen;
+
+    return dataLen;
+}
+
+static bool discardPut(char c) { (void)c; return true; }
+static uint32_t zeroMillis(void) { return 0; }
+static void noDelay(uint32_t ms) { (void)ms; }
+static void noPin(bool state) { (void)state; }
+
+static const SimpleBLEBackendInterface benchIfc = {
+    noPin, noPin, discardPut, streamGet, zeroMillis, noDelay, NULL,
+    NULL, streamRead, NULL, NULL
+};
+
+static const char cmdEnding[] = "\r";
+static const char cmdAck[] = "\nOK\r\n";
+static const char cmdError[] = "ERROR\r\n";
+
+
+static void report(const char *name, BenchClock::time_point start,
+                   uint32_t ops, uint32_t bytesPerOp)
+{
+    double ns = std::chrono::duration<double, std::nano>(BenchClock::now() - start).count();
+
+    printf("%s,%u,%.1f,%u\n", name, ops, ns / ops, bytesPerOp);
+}
+
+static void benchMakeCharHandle(void)
+{
+    SimpleBLEBackend backend(&benchIfc);
+    SimpleBLEBackend::CharHandle handle;
+    uint32_t formatted = 0;
+
+    BenchClock::time_point start = BenchClock::now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++)
+    {
+        backend.makeCharHandle(i & 0x0F, (i >> 4) & 0xFF, &handle);
+        formatted += handle.argsLen;
+    }
+    report("makeCharHandle", start, BENCH_OPS, formatted / BENCH_OPS);
+    sink = formatted;
+}
+
+static void benchLineParser(void)
+{
+    static const AtLineSchema schema = { "^READCHAR:", 2 };
+    static const char line[] = "^READCHAR: 244,1";
+    LineView view = { line, sizeof(line) - 1, NULL, 0 };
+    AtLineParser parser;
+    int32_t fields[2];
+
+    BenchClock::time_point start = BenchClock::now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++)
+    {
+        parser.start(&schema, fields);
+        sink = parser.parse(view) + fields[0];
+    }
+    report("AtLineParser::parse", start, BENCH_OPS, sizeof(line) - 1);
+}
+
+static void urcSink(const LineView &line, int8_t urc, void *context)
+{
+    (void)context;
+
+    sink = urc + line.length();
+}
+
+static void benchUrcDispatch(void)
+{
+    // Same prefixes as the backend registers.
+    static const AtUrcEntry urcTable[] = {
+        { "^START",     NULL },
+        { "^CHARWRITE", urcSink },
+        { "^ADDSRV:",   NULL },
+        { "^ADDCHAR:",  NULL },
+        { "^READCHAR:", NULL },
+    };
+    static const char input[] = "^CHARWRITE: 0,3,20\r\n";
+    AtProcess at(discardPut, streamGet, noDelay, zeroMillis);
+    AtProcessInit init = { cmdEnding, cmdAck, cmdError, urcTable,
+                           sizeof(urcTable)/sizeof(urcTable[0]), NULL };
+
+    at.init(&init);
+
+    BenchClock::time_point start = BenchClock::now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++)
+    {
+        setStream(input);
+        at.process();
+    }
+    report("AtProcess::process_urc", start, BENCH_OPS, sizeof(input) - 1);
+}
+
+static void benchGetLine(void)
+{
+    static const char input[] = "^CHARWRITE: 0,3,20\r\n";
+    AtProcess at(discardPut, streamGet, noDelay, zeroMillis);
+    AtProcessInit init = { cmdEnding, cmdAck, cmdError, NULL, 0, NULL };
+    char line[MAX_LINE_LEN_B];
+
+    at.init(&init);
+
+    BenchClock::time_point start = BenchClock::now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++)
+    {
+        setStream(input);
+        sink = at.getLine(line, sizeof(line), 1000);
+    }
+    report("AtProcess::getLine", start, BENCH_OPS, sizeof(input) - 1);
+}
+
+static void benchRecvResponse(const char *name, bool bulk)
+{
+    static const char input[] = "^READCHAR: 20,1\r\n\r\nOK\r\n";
+    AtProcess at(discardPut, streamGet, noDelay, zeroMillis, NULL,
+                 NULL, bulk ? streamRead : NULL);
+    AtProcessInit init = { cmdEnding, cmdAck, cmdError, NULL, 0, NULL };
+
+    at.init(&init);
+
+    BenchClock::time_point start = BenchClock::now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++)
+    {
+        setStream(input);
+        sink = at.recvResponseWaitOk(1000);
+    }
+    report(name, start, BENCH_OPS, sizeof(input) - 1);
+}
+
+
+int main(void)
+{
+    printf("name,ops,ns_per_op,bytes_per_op\n");
+
+    benchMakeCharHandle();
+    benchLineParser();
+    benchUrcDispatch();
+    benchGetLine();
+    benchRecvResponse("AtProcess::recvResponse", false);
+    benchRecvResponse("AtProcess::recvResponse_bulk", true);
+
+    return 0;
+}
@@ -0,0 +1,1015 @@
+#include "sim_module.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define NO_EVENT                                                    (UINT64_MAX)
+
+
+static const SimModuleConfig defaultConfig = {
+    SIM_DEFAULT_BAUD,
+    2000,   // rxTimeoutUs
+    300,    // cmdProcessUs
+    50,     // bootMs
+    10,     // rxReadyMs
+    0,      // hostMaxBaud
+};
+
+static const uint32_t supportedBauds[] = {
+    1200, 2400, 4800, 9600, 14400, 19200, 28800, 31250, 38400, 56000, 76800,
+    115200, 230400, 250000, 460800, 921600, 1000000
+};
+
+static const int8_t supportedTxPowers[] = {
+    -40, -20, -16, -12, -8, -4, 0, 2, 3, 4
+};
+
+
+SimModule *SimModule::active = NULL;
+
+const SimpleBLEBackendInterface SimModule::hostInterface = {
+    [](bool state) { active->setRxEnabled(state); },
+    [](bool state) { active->setReset(state); },
+    [](char c) { return active->hostPut(c); },
+    [](char *c) { return active->hostGet(c); },
+    [](void) { return active->millis(); },
+    [](uint32_t ms) { active->delayMs(ms); },
+    [](const char *dbg) { if( active->debug ) printf("%s", dbg); },
+    [](const uint8_t *data, uint32_t dataLen) { return active->hostWrite(data, dataLen); },
+    [](uint8_t *data, uint32_t dataLen) { return active->hostRead(data, dataLen); },
+    [](uint32_t ms) { return active->hostWaitRx(ms); },
+    [](uint32_t baud) { return active->hostSetBaud(baud); },
+};
+
+
+static bool isCmd(const char *name, uint8_t nameLen, const char *cmd)
+{
+    return strlen(cmd) == nameLen && !strncmp(name, cmd, nameLen);
+}
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t dataLen)
+{
+    for(uint32_t i = 0; i < dataLen; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+
+        for(uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+// Frame types, see framed_backend.h .
+enum SimFrameType
+{
+    SIM_FRAME_WRITE = 0x01,
+    SIM_FRAME_READ = 0x02,
+    SIM_FRAME_WRITE_ACK = 0x81,
+    SIM_FRAME_READ_RESP = 0x82,
+    SIM_FRAME_CHARWRITE = 0x83
+};
+
+static uint32_t buildFrame(uint8_t *out, uint8_t type, uint8_t seq,
+                           const uint8_t *fields, uint8_t fieldsLen,
+                           const uint8_t *data, uint32_t dataLen)
+{
+    uint32_t bodyLen = 2 + fieldsLen + dataLen + 2;
+    uint32_t len = 0;
+
+    out[len++] = SIM_FRAME_SYNC;
+    out[len++] = bodyLen;
+    out[len++] = bodyLen >> 8;
+    out[len++] = type;
+    out[len++] = seq;
+    memcpy(&out[len], fields, fieldsLen);
+    len += fieldsLen;
+    if( dataLen )
+    {
+        memcpy(&out[len], data, dataLen);
+        len += dataLen;
+    }
+
+    uint16_t crc = crc16(0xFFFF, &out[3], len - 3);
+    out[len++] = crc;
+    out[len++] = crc >> 8;
+
+    return len;
+}
+
+
+SimModule::SimModule(const SimModuleConfig *config) :
+    cfg(config ? *config : defaultConfig),
+    nowUs(0),
+    debug(false),
+    powered(false),
+    rxEnabled(true),
+    rxReadyAt(0)
+{
+    clearStats();
+
+    hostCurBaud = cfg.baud;
+
+    toModule.head = toModule.len = 0;
+    toModule.freeAt = 0;
+    toHost.head = toHost.len = 0;
+    toHost.freeAt = 0;
+
+    // Module is already running when the host starts.
+    powerUp();
+    bootAt = nowUs;
+}
+
+void SimModule::powerUp(void)
+{
+    powered = true;
+    booting = true;
+    bootAt = nowUs + (uint64_t)cfg.bootMs*1000;
+    curBaud = cfg.baud;
+    pendingBaud = 0;
+
+    batchLen = 0;
+    rxHead = 0;
+    rxLen = 0;
+
+    state = CMD_LINE;
+    cmdLen = 0;
+    responseLen = 0;
+    restartPending = false;
+    framesEnabled = false;
+    frameResponse = false;
+    frameLen = 0;
+    dataTarget = NULL;
+    dataLeft = 0;
+    urcsLen = 0;
+
+    numServices = 0;
+    isAdvertising = false;
+    txPower = 0;
+}
+
+void SimModule::setRxEnabled(bool state)
+{
+    runUntil(nowUs, false);
+
+    if( state && !rxEnabled )
+    {
+        rxReadyAt = nowUs + (uint64_t)cfg.rxReadyMs*1000;
+
+        // New speed applies when reception is enabled again.
+        if( pendingBaud )
+        {
+            curBaud = pendingBaud;
+            pendingBaud = 0;
+        }
+    }
+
+    rxEnabled = state;
+}
+
+void SimModule::setReset(bool state)
+{
+    runUntil(nowUs, false);
+
+    if( !state )
+    {
+        powered = false;
+    }
+    else if( !powered )
+    {
+        powerUp();
+    }
+}
+
+bool SimModule::hostPut(char c)
+{
+    runUntil(nowUs, false);
+
+    uint64_t start = toModule.freeAt > nowUs ? toModule.freeAt : nowUs ;
+    uint64_t at = start + byteUs(hostCurBaud);
+
+    if( !push(toModule, c, at, hostCurBaud) )
+    {
+        return false;
+    }
+
+    toModule.freeAt = at;
+    simStats.hostBytes++;
+
+    return true;
+}
+
+bool SimModule::hostGet(char *c)
+{
+    runUntil(nowUs, false);
+
+    if( !hostRxReady() )
+    {
+        return false;
+    }
+
+    *c = receive(toHost.bytes[toHost.head], hostCurBaud);
+    toHost.head = (toHost.head + 1) % SIM_WIRE_B;
+    toHost.len--;
+
+    return true;
+}
+
+uint32_t SimModule::hostWrite(const uint8_t *data, uint32_t dataLen)
+{
+    uint32_t written = 0;
+
+    for(; written < dataLen && hostPut(data[written]); written++);
+
+    return written;
+}
+
+uint32_t SimModule::hostRead(uint8_t *data, uint32_t dataLen)
+{
+    uint32_t readLen = 0;
+
+    for(; readLen < dataLen && hostGet((char*)&data[readLen]); readLen++);
+
+    return readLen;
+}
+
+bool SimModule::hostWaitRx(uint32_t ms)
+{
+    runUntil(nowUs + (uint64_t)ms*1000, true);
+
+    return hostRxReady();
+}
+
+bool SimModule::hostSetBaud(uint32_t baud)
+{
+    runUntil(nowUs, false);
+
+    if( !baud || (cfg.hostMaxBaud && baud > cfg.hostMaxBaud) )
+    {
+        return false;
+    }
+
+    hostCurBaud = baud;
+
+    return true;
+}
+
+void SimModule::delayMs(uint32_t ms)
+{
+    runUntil(nowUs + (uint64_t)ms*1000, false);
+}
+
+void SimModule::advance(uint64_t us)
+{
+    runUntil(nowUs + us, false);
+}
+
+bool SimModule::peerWrite(uint8_t service, uint8_t characteristic,
+                          const uint8_t *data, uint32_t dataLen)
+{
+    runUntil(nowUs, false);
+
+    Characteristic *ch = findChar(service, characteristic);
+
+    if( !ch || dataLen > ch->maxSize )
+    {
+        return false;
+    }
+
+    memcpy(ch->data, data, dataLen);
+    ch->size = dataLen;
+    ch->newData = true;
+
+    if( framesEnabled )
+    {
+        uint8_t fields[4] = { service, characteristic,
+                              (uint8_t)dataLen, (uint8_t)(dataLen >> 8) };
+        uint8_t frame[16];
+
+        queueUrc(frame, buildFrame(frame, SIM_FRAME_CHARWRITE, 0, fields, sizeof(fields), NULL, 0));
+        return true;
+    }
+
+    char urc[40];
+    snprintf(urc, sizeof(urc), "^CHARWRITE: %u,%u,%u\r\n",
+             service, characteristic, (unsigned)dataLen);
+    queueUrc(urc);
+
+    return true;
+}
+
+int32_t SimModule::peerRead(uint8_t service, uint8_t characteristic,
+                            uint8_t *buff, uint32_t buffSize)
+{
+    runUntil(nowUs, false);
+
+    Characteristic *ch = findChar(service, characteristic);
+
+    if( !ch )
+    {
+        return -1;
+    }
+
+    memcpy(buff, ch->data, ch->size < buffSize ? ch->size : buffSize);
+
+    return ch->size;
+}
+
+void SimModule::runUntil(uint64_t until, bool stopOnRx)
+{
+    for(;;)
+    {
+        handleEvents();
+
+        if( stopOnRx && hostRxReady() )
+        {
+            return;
+        }
+
+        uint64_t next = nextEvent();
+
+        if( next > until )
+        {
+            break;
+        }
+
+        nowUs = next;
+    }
+
+    nowUs = until > nowUs ? until : nowUs ;
+}
+
+uint64_t SimModule::nextEvent(void)
+{
+    uint64_t next = NO_EVENT;
+
+    if( toModule.len )
+    {
+        next = toModule.bytes[toModule.head].at;
+    }
+
+    if( toHost.len && toHost.bytes[toHost.head].at > nowUs &&
+        toHost.bytes[toHost.head].at < next )
+    {
+        next = toHost.bytes[toHost.head].at;
+    }
+
+    if( powered )
+    {
+        if( batchLen && batchLastAt + cfg.rxTimeoutUs < next )
+        {
+            next = batchLastAt + cfg.rxTimeoutUs;
+        }
+
+        if( state == CMD_BUSY && busyUntil < next )
+        {
+            next = busyUntil;
+        }
+
+        if( booting && bootAt < next )
+        {
+            next = bootAt;
+        }
+    }
+
+    return next;
+}
+
+void SimModule::handleEvents(void)
+{
+    if( powered && booting && bootAt <= nowUs )
+    {
+        booting = false;
+        emit("^START\r\n");
+        simStats.urcs++;
+    }
+
+    while( toModule.len && toModule.bytes[toModule.head].at <= nowUs )
+    {
+        const WireByte &wb = toModule.bytes[toModule.head];
+        toModule.head = (toModule.head + 1) % SIM_WIRE_B;
+        toModule.len--;
+
+        if( !powered || booting || !rxEnabled || wb.at < rxReadyAt )
+        {
+            simStats.droppedBytes++;
+            continue;
+        }
+
+        batch[batchLen++] = receive(wb, curBaud);
+        batchLastAt = wb.at;
+
+        if( batchLen == SIM_RX_BATCH_B )
+        {
+            flushBatch();
+        }
+    }
+
+    if( !powered )
+    {
+        return;
+    }
+
+    if( batchLen && batchLastAt + cfg.rxTimeoutUs <= nowUs )
+    {
+        simStats.partialBatches++;
+        flushBatch();
+    }
+
+    if( state == CMD_BUSY && busyUntil <= nowUs )
+    {
+        finishCommand();
+    }
+}
+
+void SimModule::flushBatch(void)
+{
+    simStats.batches++;
+
+    for(uint8_t i = 0; i < batchLen; i++)
+    {
+        if( rxLen < SIM_RX_BUFFER_B )
+        {
+            rxBuff[(rxHead + rxLen++) % SIM_RX_BUFFER_B] = batch[i];
+        }
+        else
+        {
+            simStats.droppedBytes++;
+        }
+    }
+
+    batchLen = 0;
+
+    consumeRx();
+}
+
+void SimModule::consumeRx(void)
+{
+    while( rxLen && state != CMD_BUSY )
+    {
+        uint8_t c = rxBuff[rxHead];
+        rxHead = (rxHead + 1) % SIM_RX_BUFFER_B;
+        rxLen--;
+
+        if( state == CMD_DATA )
+        {
+            dataChar(c);
+        }
+        else if( state == CMD_FRAME )
+        {
+            frameChar(c);
+        }
+        else
+        {
+            lineChar(c);
+        }
+    }
+}
+
+void SimModule::lineChar(uint8_t c)
+{
+    if( framesEnabled && cmdLen == 0 && c == SIM_FRAME_SYNC )
+    {
+        state = CMD_FRAME;
+        frameLen = 0;
+        frameChar(c);
+    }
+    else if( c == '\r' )
+    {
+        if( cmdLen )
+        {
+            emit("\r\n");
+            cmdLine[cmdLen] = '\0';
+            cmdLen = 0;
+            execute();
+        }
+    }
+    else if( c == '\n' || c == '\0' )
+    {
+        // Line feeds and fill characters between commands are ignored.
+    }
+    else
+    {
+        emit(c);
+
+        if( cmdLen < SIM_MAX_CMD_LEN_B )
+        {
+            cmdLine[cmdLen++] = c;
+        }
+    }
+}
+
+void SimModule::dataChar(uint8_t c)
+{
+    if( dataTarget && dataPos < dataTarget->maxSize )
+    {
+        dataTarget->data[dataPos] = c;
+    }
+    dataPos++;
+
+    if( --dataLeft == 0 )
+    {
+        if( dataTarget )
+        {
+            dataTarget->size = dataPos;
+        }
+
+        state = CMD_BUSY;
+        busyUntil = nowUs + cfg.cmdProcessUs;
+    }
+}
+
+void SimModule::frameChar(uint8_t c)
+{
+    frameBuff[frameLen++] = c;
+
+    if( frameLen < 3 )
+    {
+        return;
+    }
+
+    uint32_t bodyLen = frameBuff[1] | (uint32_t)frameBuff[2] << 8;
+
+    if( bodyLen == 0 || 3 + bodyLen > SIM_MAX_FRAME_B )
+    {
+        simStats.droppedBytes += frameLen;
+        state = CMD_LINE;
+    }
+    else if( frameLen == 3 + bodyLen )
+    {
+        executeFrame();
+    }
+}
+
+void SimModule::executeFrame(void)
+{
+    const uint8_t *body = &frameBuff[3];
+    uint32_t bodyLen = frameLen - 3;
+
+    simStats.commands++;
+    simStats.frames++;
+    responseLen = 0;
+    frameResponse = true;
+
+    state = CMD_BUSY;
+    busyUntil = nowUs + cfg.cmdProcessUs;
+
+    // Frame that can't be trusted is not answered, host times out.
+    if( bodyLen < 4 ||
+        crc16(0xFFFF, body, bodyLen - 2) != (body[bodyLen - 2] | (uint16_t)body[bodyLen - 1] << 8) )
+    {
+        simStats.errors++;
+        return;
+    }
+
+    uint8_t type = body[0];
+    uint8_t seq = body[1];
+    const uint8_t *fields = &body[2];
+    uint32_t fieldsLen = bodyLen - 4;
+
+    if( type == SIM_FRAME_WRITE && fieldsLen >= 2 )
+    {
+        Characteristic *ch = findChar(fields[0], fields[1]);
+        uint32_t dataLen = fieldsLen - 2;
+        uint8_t status = ch && dataLen <= ch->maxSize ? 0 : 1;
+
+        if( status == 0 )
+        {
+            memcpy(ch->data, &fields[2], dataLen);
+            ch->size = dataLen;
+        }
+        else
+        {
+            simStats.errors++;
+        }
+
+        responseLen = buildFrame(response, SIM_FRAME_WRITE_ACK, seq, &status, 1, NULL, 0);
+    }
+    else if( type == SIM_FRAME_READ && fieldsLen >= 3 )
+    {
+        Characteristic *ch = findChar(fields[0], fields[1]);
+        uint8_t respFields[4] = { 1, 0, 0, 0 };
+        bool returnData = ch && fields[2];
+
+        if( ch )
+        {
+            respFields[0] = 0;
+            respFields[1] = ch->newData ? 1 : 0;
+            respFields[2] = ch->size;
+            respFields[3] = ch->size >> 8;
+        }
+        else
+        {
+            simStats.errors++;
+        }
+
+        responseLen = buildFrame(response, SIM_FRAME_READ_RESP, seq, respFields, sizeof(respFields),
+                                 returnData ? ch->data : NULL, returnData ? ch->size : 0);
+
+        if( returnData )
+        {
+            ch->newData = false;
+        }
+    }
+    else
+    {
+        simStats.errors++;
+    }
+}
+
+void SimModule::execute(void)
+{
+    int32_t args[4];
+    uint8_t numArgs = 0;
+
+    simStats.commands++;
+    responseLen = 0;
+    dataTarget = NULL;
+    dataLeft = 0;
+    dataPos = 0;
+
+    state = CMD_BUSY;
+    busyUntil = nowUs + cfg.cmdProcessUs;
+
+do{
+    if( strncmp(cmdLine, "AT", 2) )
+    {
+        respondError();
+        break;
+    }
+
+    if( cmdLine[2] == '\0' )
+    {
+        break;
+    }
+
+    if( cmdLine[2] != '+' )
+    {
+        respondError();
+        break;
+    }
+
+    const char *name = &cmdLine[3];
+    uint8_t nameLen = strcspn(name, "=?");
+    bool isRead = name[nameLen] == '?';
+    const char *argStr = name[nameLen] == '=' ? &name[nameLen + 1] : NULL;
+
+    if( argStr )
+    {
+        numArgs = parseArgs(argStr, args, sizeof(args)/sizeof(args[0]));
+    }
+
+    char line[40];
+
+    if( isCmd(name, nameLen, "RESTART") )
+    {
+        restartPending = true;
+    }
+    else if( isCmd(name, nameLen, "SETBAUD") )
+    {
+        bool supported = false;
+
+        for(uint8_t i = 0; numArgs == 1 && i < sizeof(supportedBauds)/sizeof(supportedBauds[0]); i++)
+        {
+            supported |= supportedBauds[i] == (uint32_t)args[0];
+        }
+
+        if( !supported )
+        {
+            respondError();
+            break;
+        }
+
+        pendingBaud = args[0];
+    }
+    else if( isCmd(name, nameLen, "STAT") && isRead )
+    {
+        snprintf(line, sizeof(line), "^STAT: %u,0\r\n", isAdvertising ? 1 : 0);
+        respond(line);
+    }
+    else if( isCmd(name, nameLen, "ADVSTART") )
+    {
+        if( isRead )
+        {
+            snprintf(line, sizeof(line), "^ADVSTART: %u\r\n", isAdvertising ? 1 : 0);
+            respond(line);
+        }
+        else
+        {
+            isAdvertising = true;
+        }
+    }
+    else if( isCmd(name, nameLen, "ADVSTOP") )
+    {
+        isAdvertising = false;
+    }
+    else if( isCmd(name, nameLen, "ADVPAYLOAD") )
+    {
+        if( numArgs != 2 || args[1] < 0 )
+        {
+            respondError();
+            break;
+        }
+
+        dataLeft = args[1];
+    }
+    else if( isCmd(name, nameLen, "TXPOWER") )
+    {
+        if( isRead )
+        {
+            snprintf(line, sizeof(line), "^TXPOWER: %d\r\n", txPower);
+            respond(line);
+            break;
+        }
+
+        bool supported = false;
+
+        for(uint8_t i = 0; numArgs == 1 && i < sizeof(supportedTxPowers)/sizeof(supportedTxPowers[0]); i++)
+        {
+            supported |= supportedTxPowers[i] == args[0];
+        }
+
+        if( !supported )
+        {
+            respondError();
+            break;
+        }
+
+        txPower = args[0];
+    }
+    else if( isCmd(name, nameLen, "ADDSRV") )
+    {
+        if( numArgs != 1 || numServices >= SIM_MAX_SERVICES )
+        {
+            respondError();
+            break;
+        }
+
+        Service &srv = services[numServices];
+        srv.uuid = args[0];
+        srv.numChars = 0;
+
+        snprintf(line, sizeof(line), "^ADDSRV: %u\r\n", numServices++);
+        respond(line);
+    }
+    else if( isCmd(name, nameLen, "ADDCHAR") )
+    {
+        if( numArgs != 3 || args[0] < 0 || args[0] >= numServices ||
+            services[args[0]].numChars >= SIM_MAX_CHARS ||
+            args[1] <= 0 || args[1] > SIM_MAX_CHAR_SIZE_B )
+        {
+            respondError();
+            break;
+        }
+
+        Service &srv = services[args[0]];
+        Characteristic &ch = srv.chars[srv.numChars];
+        ch.maxSize = args[1];
+        ch.size = 0;
+        ch.flags = args[2];
+        ch.newData = false;
+
+        snprintf(line, sizeof(line), "^ADDCHAR: %u\r\n", srv.numChars++);
+        respond(line);
+    }
+    else if( isCmd(name, nameLen, "READCHAR") )
+    {
+        Characteristic *ch = numArgs == 3 ? findChar(args[0], args[1]) : NULL ;
+
+        if( !ch )
+        {
+            respondError();
+            break;
+        }
+
+        snprintf(line, sizeof(line), "^READCHAR: %u,%u\r\n",
+                 (unsigned)ch->size, ch->newData ? 1 : 0);
+        respond(line);
+
+        if( args[2] )
+        {
+            respond(ch->data, ch->size);
+            respond("\r\n");
+            ch->newData = false;
+        }
+    }
+    else if( isCmd(name, nameLen, "WRITECHAR") )
+    {
+        if( numArgs != 3 || args[2] < 0 )
+        {
+            respondError();
+            break;
+        }
+
+        // Data is received even if it can't be stored, so it isn't mistaken
+        // for the next command.
+        dataTarget = findChar(args[0], args[1]);
+        dataLeft = args[2];
+
+        if( !dataTarget || (uint32_t)args[2] > dataTarget->maxSize )
+        {
+            dataTarget = NULL;
+            respondError();
+        }
+    }
+    else if( isCmd(name, nameLen, "FORCEDISC") )
+    {
+    }
+    else if( isCmd(name, nameLen, "FRAMES") )
+    {
+        if( numArgs != 1 || args[0] < 0 || args[0] > 1 )
+        {
+            respondError();
+            break;
+        }
+
+        framesEnabled = args[0];
+    }
+    else
+    {
+        respondError();
+    }
+}while(0);
+
+    if( dataLeft )
+    {
+        state = CMD_DATA;
+    }
+}
+
+void SimModule::finishCommand(void)
+{
+    for(uint32_t i = 0; i < responseLen; i++)
+    {
+        emit(response[i]);
+    }
+
+    // Frames carry their status, only AT commands end with OK.
+    if( !frameResponse )
+    {
+        emit("OK\r\n");
+    }
+    frameResponse = false;
+
+    if( urcsLen )
+    {
+        for(uint32_t i = 0; i < urcsLen; i++)
+        {
+            emit(urcs[i]);
+        }
+        urcsLen = 0;
+    }
+
+    state = CMD_LINE;
+
+    if( restartPending )
+    {
+        uint64_t txFreeAt = toHost.freeAt;
+
+        powerUp();
+
+        // Module restarts only after OK is sent.
+        bootAt = (txFreeAt > nowUs ? txFreeAt : nowUs) + (uint64_t)cfg.bootMs*1000;
+        return;
+    }
+
+    consumeRx();
+}
+
+bool SimModule::push(Wire &wire, uint8_t c, uint64_t at, uint32_t baud)
+{
+    if( wire.len >= SIM_WIRE_B )
+    {
+        return false;
+    }
+
+    WireByte &wb = wire.bytes[(wire.head + wire.len++) % SIM_WIRE_B];
+    wb.at = at;
+    wb.baud = baud;
+    wb.c = c;
+
+    return true;
+}
+
+uint8_t SimModule::receive(const WireByte &wb, uint32_t baud)
+{
+    if( wb.baud == baud )
+    {
+        return wb.c;
+    }
+
+    // Byte sampled at the wrong speed turns into garbage. High bit keeps it
+    // from ever looking like a line ending.
+    simStats.garbledBytes++;
+
+    return (wb.c ^ 0x5A) | 0x80;
+}
+
+bool SimModule::hostRxReady(void)
+{
+    return toHost.len && toHost.bytes[toHost.head].at <= nowUs;
+}
+
+void SimModule::emit(uint8_t c)
+{
+    uint64_t start = toHost.freeAt > nowUs ? toHost.freeAt : nowUs ;
+    uint64_t at = start + byteUs(curBaud);
+
+    if( !push(toHost, c, at, curBaud) )
+    {
+        simStats.droppedBytes++;
+        return;
+    }
+
+    toHost.freeAt = at;
+    simStats.moduleBytes++;
+}
+
+void SimModule::emit(const char *str)
+{
+    while( *str )
+    {
+        emit((uint8_t)*str++);
+    }
+}
+
+void SimModule::respond(const char *str)
+{
+    respond((const uint8_t*)str, strlen(str));
+}
+
+void SimModule::respond(const uint8_t *data, uint32_t dataLen)
+{
+    dataLen = dataLen < SIM_RESPONSE_B - responseLen ? dataLen : SIM_RESPONSE_B - responseLen;
+
+    memcpy(&response[responseLen], data, dataLen);
+    responseLen += dataLen;
+}
+
+void SimModule::respondError(void)
+{
+    simStats.errors++;
+    respond("ERROR\r\n");
+}
+
+void SimModule::queueUrc(const char *urc)
+{
+    queueUrc((const uint8_t*)urc, strlen(urc));
+}
+
+void SimModule::queueUrc(const uint8_t *urc, uint32_t urcLen)
+{
+    simStats.urcs++;
+
+    // URCs don't break into a command that is being received or executed.
+    if( powered && !booting && state == CMD_LINE && cmdLen == 0 )
+    {
+        for(uint32_t i = 0; i < urcLen; i++)
+        {
+            emit(urc[i]);
+        }
+        return;
+    }
+
+    if( urcsLen + urcLen <= SIM_URC_B )
+    {
+        memcpy(&urcs[urcsLen], urc, urcLen);
+        urcsLen += urcLen;
+    }
+}
+
+uint8_t SimModule::parseArgs(const char *args, int32_t *values, uint8_t maxValues)
+{
+    uint8_t numValues = 0;
+
+    while( *args && numValues < maxValues )
+    {
+        char *end;
+        values[numValues++] = strtol(args, &end, 10);
+
+        if( end == args || (*end != ',' && *end != '\0') )
+        {
+            return 0;
+        }
+
+        args = *end ? end + 1 : end;
+    }
+
+    return *args ? 0 : numValues;
+}
+
+SimModule::Characteristic *SimModule::findChar(int32_t service, int32_t characteristic)
+{
+    if( service < 0 || service >= numServices ||
+        characteristic < 0 || characteristic >= services[service].numChars )
+    {
+        return NULL;
+    }
+
+    return &services[service].chars[characteristic];
+}
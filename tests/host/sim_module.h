@@ -0,0 +1,268 @@
+#ifndef __SIM_MODULE_H__
+#define __SIM_MODULE_H__
+
+#include "simple_ble_backend.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * Host side model of the Simple BLE module AT firmware, for running the
+ * library on a PC without a module. It runs on virtual time, so results don't
+ * depend on the speed of the host. Build it together with library sources:
+ *
+ *   g++ -std=gnu++11 -Isimpleble -Itests/host tests/host/sim_module.cpp \
+ *       simpleble/at_process.cpp simpleble/at_parser.cpp \
+ *       simpleble/simple_ble_backend.cpp simpleble/framed_backend.cpp \
+ *       simpleble/simple_ble.cpp simpleble/timeout.cpp <test>.cpp
+ *
+ * Add -DSIMPLEBLE_FRAMED_BACKEND to run SimpleBLE with binary frames, and
+ * -DSIMPLEBLE_RX_BLOCK_FILL=1 to pad commands to full RX batches.
+ */
+
+
+#define SIM_MAX_SERVICES                                            (8)
+#define SIM_MAX_CHARS                                               (10)
+#define SIM_MAX_CHAR_SIZE_B                                         (512)
+// Bytes that can be on the wire in each direction at once.
+#define SIM_WIRE_B                                                  (4096)
+// Module UART hands received bytes to the firmware in batches of this size.
+#define SIM_RX_BATCH_B                                              (6)
+// Received bytes the firmware buffers while it processes a command.
+#define SIM_RX_BUFFER_B                                             (256)
+#define SIM_MAX_CMD_LEN_B                                           (80)
+#define SIM_RESPONSE_B                                              (SIM_MAX_CHAR_SIZE_B + 64)
+#define SIM_URC_B                                                   (256)
+#define SIM_DEFAULT_BAUD                                            (9600)
+// Binary frames enabled with AT+FRAMES=1, see framed_backend.h .
+#define SIM_FRAME_SYNC                                              (0xA5)
+#define SIM_MAX_FRAME_B                                             (3 + 6 + SIM_MAX_CHAR_SIZE_B + 2)
+
+
+/**
+ * @brief Timing of the simulated module.
+ */
+struct SimModuleConfig
+{
+    uint32_t baud;         /*!< UART speed after power up and restart. */
+    uint32_t rxTimeoutUs;  /*!< Idle time after which incomplete RX batch is
+                                processed. */
+    uint32_t cmdProcessUs; /*!< Time firmware spends on each command. */
+    uint32_t bootMs;       /*!< Time from reset to ^START. */
+    uint32_t rxReadyMs;    /*!< Time from RXEN assertion until UART receives. */
+    uint32_t hostMaxBaud;  /*!< Highest speed host UART accepts, 0 for any. */
+};
+
+
+class SimModule
+{
+public:
+
+    /**
+     * @brief Counters of simulated traffic.
+     */
+    struct Stats
+    {
+        uint32_t commands;       /*!< Commands executed. */
+        uint32_t errors;         /*!< Commands answered with ERROR. */
+        uint32_t urcs;           /*!< URCs sent. */
+        uint32_t hostBytes;      /*!< Bytes sent by the host. */
+        uint32_t moduleBytes;    /*!< Bytes sent by the module. */
+        uint32_t batches;        /*!< RX batches handed to the firmware. */
+        uint32_t partialBatches; /*!< Batches handed over after RX timeout. */
+        uint32_t droppedBytes;   /*!< Bytes lost to disabled RX or overflow. */
+        uint32_t garbledBytes;   /*!< Bytes received at the wrong speed. */
+        uint32_t frames;         /*!< Frames executed, also in commands. */
+    };
+
+    /**
+     * @brief Construct a new simulated module, powered up and started.
+     *
+     * @param config Module timing, or NULL for defaults.
+     */
+    SimModule(const SimModuleConfig *config = NULL);
+
+    /**
+     * @brief Make this module the one behind @ref hostInterface .
+     */
+    inline void bind(void) { active = this; }
+
+    /**
+     * @brief Library interface wired to the module last passed to
+     *        @ref bind . Debug print goes to stdout if @ref setDebug is on.
+     */
+    static const SimpleBLEBackendInterface hostInterface;
+
+    // Host side of the link, the same functions as in the interface.
+    void setRxEnabled(bool state);
+    void setReset(bool state);
+    bool hostPut(char c);
+    bool hostGet(char *c);
+    uint32_t hostWrite(const uint8_t *data, uint32_t dataLen);
+    uint32_t hostRead(uint8_t *data, uint32_t dataLen);
+    bool hostWaitRx(uint32_t ms);
+    bool hostSetBaud(uint32_t baud);
+    inline uint32_t millis(void) { return nowUs/1000; }
+    void delayMs(uint32_t ms);
+
+    /**
+     * @brief Virtual time in microseconds.
+     */
+    inline uint64_t micros(void) { return nowUs; }
+
+    /**
+     * @brief Run the module for given time without the host doing anything.
+     */
+    void advance(uint64_t us);
+
+    /**
+     * @brief Write characteristic from the BLE side, as a connected central
+     *        would. Module sends ^CHARWRITE to the host.
+     *
+     * @return true If characteristic exists and data fits in it.
+     */
+    bool peerWrite(uint8_t service, uint8_t characteristic,
+                   const uint8_t *data, uint32_t dataLen);
+
+    /**
+     * @brief Read characteristic from the BLE side.
+     *
+     * @return int32_t Characteristic size, or -1 if it doesn't exist.
+     */
+    int32_t peerRead(uint8_t service, uint8_t characteristic,
+                     uint8_t *buff, uint32_t buffSize);
+
+    inline const Stats& stats(void) { return simStats; }
+    inline void clearStats(void) { memset(&simStats, 0, sizeof(simStats)); }
+    inline uint32_t baud(void) { return curBaud; }
+    inline uint32_t hostBaud(void) { return hostCurBaud; }
+    inline bool frames(void) { return framesEnabled; }
+    inline bool advertising(void) { return isAdvertising; }
+    inline void setDebug(bool on) { debug = on; }
+
+private:
+    struct WireByte
+    {
+        uint64_t at;    /*!< Virtual time when the byte is fully received. */
+        uint32_t baud;  /*!< Speed it was sent at. */
+        uint8_t c;
+    };
+
+    struct Wire
+    {
+        WireByte bytes[SIM_WIRE_B];
+        uint32_t head;
+        uint32_t len;
+        uint64_t freeAt; /*!< Time when the last byte leaves the sender. */
+    };
+
+    struct Characteristic
+    {
+        uint32_t maxSize;
+        uint32_t size;
+        uint8_t flags;
+        bool newData;
+        uint8_t data[SIM_MAX_CHAR_SIZE_B];
+    };
+
+    struct Service
+    {
+        uint8_t uuid;
+        uint8_t numChars;
+        Characteristic chars[SIM_MAX_CHARS];
+    };
+
+    enum CmdState
+    {
+        CMD_LINE,  /*!< Receiving command line. */
+        CMD_DATA,  /*!< Receiving raw data of a write command. */
+        CMD_FRAME, /*!< Receiving binary frame. */
+        CMD_BUSY   /*!< Executing command, response not sent yet. */
+    };
+
+    static SimModule *active;
+
+    void powerUp(void);
+    void runUntil(uint64_t until, bool stopOnRx);
+    uint64_t nextEvent(void);
+    void handleEvents(void);
+    void flushBatch(void);
+    void consumeRx(void);
+    void lineChar(uint8_t c);
+    void dataChar(uint8_t c);
+    void frameChar(uint8_t c);
+    void execute(void);
+    void executeFrame(void);
+    void finishCommand(void);
+
+    bool push(Wire &wire, uint8_t c, uint64_t at, uint32_t baud);
+    uint8_t receive(const WireByte &wb, uint32_t baud);
+    bool hostRxReady(void);
+    static inline uint32_t byteUs(uint32_t baud) { return 10000000UL / baud; }
+    void emit(uint8_t c);
+    void emit(const char *str);
+    void respond(const char *str);
+    void respond(const uint8_t *data, uint32_t dataLen);
+    void respondError(void);
+    void queueUrc(const char *urc);
+    void queueUrc(const uint8_t *urc, uint32_t urcLen);
+
+
+    uint8_t parseArgs(const char *args, int32_t *values, uint8_t maxValues);
+    Characteristic *findChar(int32_t service, int32_t characteristic);
+
+    SimModuleConfig cfg;
+    uint64_t nowUs;
+    Stats simStats;
+    bool debug;
+
+    Wire toModule;
+    Wire toHost;
+
+    bool powered;
+    bool rxEnabled;
+    uint64_t rxReadyAt;
+    uint64_t bootAt;
+    bool booting;
+    uint32_t curBaud;
+    uint32_t pendingBaud;
+    uint32_t hostCurBaud;
+
+    uint8_t batch[SIM_RX_BATCH_B];
+    uint8_t batchLen;
+    uint64_t batchLastAt;
+
+    uint8_t rxBuff[SIM_RX_BUFFER_B];
+    uint32_t rxHead;
+    uint32_t rxLen;
+
+    CmdState state;
+    char cmdLine[SIM_MAX_CMD_LEN_B + 1];
+    uint8_t cmdLen;
+    uint64_t busyUntil;
+    uint8_t response[SIM_RESPONSE_B];
+    uint32_t responseLen;
+    bool restartPending;
+    bool framesEnabled;
+    bool frameResponse;  /*!< Response is a frame, without OK. */
+    uint8_t frameBuff[SIM_MAX_FRAME_B];
+    uint32_t frameLen;
+
+    Characteristic *dataTarget; /*!< NULL if data is only consumed. */
+    uint32_t dataLeft;
+    uint32_t dataPos;
+    bool dataOk;
+
+    char urcs[SIM_URC_B];
+    uint32_t urcsLen;
+
+    Service services[SIM_MAX_SERVICES];
+    uint8_t numServices;
+    bool isAdvertising;
+    int8_t txPower;
+};
+
+
+#endif//__SIM_MODULE_H__
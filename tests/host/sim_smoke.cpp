@@ -0,0 +1,331 @@
+#include "simple_ble.h"
+#include "framed_backend.h"
+#include "sim_module.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * Runs the library against the simulated module and checks that commands,
+ * data and URCs pass through. Build as described in sim_module.h, with this
+ * file as the test.
+ */
+
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    printf("%s %s\n", condition ? "pass" : "FAIL", what);
+
+    if( !condition )
+    {
+        failures++;
+    }
+}
+
+
+// Input of an AtProcess without a module, to check URC dispatch alone.
+static const char *urcInput = "";
+
+static bool urcInputGet(char *c)
+{
+    if( !*urcInput )
+    {
+        return false;
+    }
+
+    *c = *urcInput++;
+
+    return true;
+}
+
+static bool discardPut(char c) { (void)c; return true; }
+static void noDelay(uint32_t ms) { (void)ms; }
+static uint32_t zeroMillis(void) { return 0; }
+
+static int8_t lastUrc;
+
+static void urcReceived(const LineView &line, int8_t urc, void *context)
+{
+    (void)line;
+    (void)context;
+
+    lastUrc = urc;
+}
+
+static int8_t dispatchUrc(AtProcess &at, const char *line)
+{
+    lastUrc = -1;
+    urcInput = line;
+    at.process();
+
+    return lastUrc;
+}
+
+// Each line goes to the handler of the longest URC prefix it starts with,
+// however many prefixes there are.
+static void checkUrcTable(void)
+{
+    static const uint8_t numUrcs = 20;
+    static char prefixes[numUrcs][8];
+    static AtUrcEntry urcTable[numUrcs + 1];
+    for(uint8_t i = 0; i < numUrcs; i++)
+    {
+        snprintf(prefixes[i], sizeof(prefixes[i]), "^U%u:", i);
+        urcTable[i].prefix = prefixes[i];
+        urcTable[i].handler = urcReceived;
+    }
+    urcTable[numUrcs].prefix = "^U1";
+    urcTable[numUrcs].handler = urcReceived;
+
+    AtProcess at(discardPut, urcInputGet, noDelay, zeroMillis);
+    AtProcessInit init = { "\r", "\nOK\r\n", "ERROR\r\n", urcTable, numUrcs + 1, NULL };
+    at.init(&init);
+
+    check(dispatchUrc(at, "^U1: 1\r\n") == 1 && dispatchUrc(at, "^U19: 1\r\n") == 19 &&
+          dispatchUrc(at, "^U1x\r\n") == numUrcs && dispatchUrc(at, "x^U1:\r\n") == -1,
+          "URC dispatch");
+}
+
+static uint32_t clockMs;
+static uint32_t clockMillis(void) { return clockMs; }
+static void clockDelay(uint32_t ms) { clockMs += ms; }
+
+static int8_t doneTickets[2];
+static AtProcess::Status doneStatus[2];
+static uint8_t numDone;
+
+static void responseDone(int8_t ticket, AtProcess::Status status, void *context)
+{
+    (void)context;
+
+    if( numDone < 2 )
+    {
+        doneTickets[numDone] = ticket;
+        doneStatus[numDone] = status;
+    }
+    numDone++;
+}
+
+// Queued commands keep their own echo and timeout. Their echoes have the same
+// signature, and the command buffer is reused before the responses arrive.
+static void checkPipeline(void)
+{
+    AtProcess at(discardPut, urcInputGet, noDelay, clockMillis);
+    AtProcessInit init = { "\r", "\nOK\r\n", "ERROR\r\n", NULL, 0, NULL };
+    at.init(&init);
+    at.setDoneHandler(responseDone, NULL);
+
+    char cmd[8];
+    strcpy(cmd, "AT+N=a~");
+    int8_t first = at.queueResponse(cmd, 8, 100);
+    strcpy(cmd, "AT+N=b]");
+    int8_t second = at.queueResponse(cmd, 8, 5000);
+
+    clockMs = 0;
+    numDone = 0;
+    urcInput = "AT+N=b]\r\n";
+    at.process();
+    check(!at.responseStatus().echoReceived, "echo confirmed by its bytes");
+
+    urcInput = "AT+N=a~\r\nOK\r\n";
+    at.process();
+    clockMs = 1000;
+    check(at.poll() == AtProcess::IN_PROGRESS && at.responseStatus().echoReceived,
+          "queued command keeps its timeout");
+
+    urcInput = "OK\r\n";
+    at.process();
+    check(numDone == 2 && doneTickets[0] == first && doneTickets[1] == second &&
+          doneStatus[0] == AtProcess::SUCCESS && doneStatus[1] == AtProcess::SUCCESS,
+          "queued responses complete in order");
+
+    numDone = 0;
+    first = at.queueResponse("AT+N=c", 8, 100);
+    second = at.queueResponse("AT+N=d", 8, 100);
+    at.startResponse("AT");
+    check(numDone == 2 && doneTickets[0] == first && doneTickets[1] == second &&
+          doneStatus[0] == AtProcess::GEN_ERROR && doneStatus[1] == AtProcess::GEN_ERROR,
+          "dropped queued responses fail");
+}
+
+// Input that never ends its line, one byte every 10 ms until it stalls.
+static uint32_t trickleBytes;
+static uint32_t trickleAt;
+
+static bool trickleGet(char *c)
+{
+    if( !trickleBytes || (int32_t)(clockMs - trickleAt) < 0 )
+    {
+        return false;
+    }
+
+    trickleBytes--;
+    trickleAt = clockMs + 10;
+    *c = 'x';
+
+    return true;
+}
+
+static uint32_t trickleResponse(AtProcess &at, uint32_t bytes, uint32_t timeout)
+{
+    uint32_t start = clockMs;
+    trickleBytes = bytes;
+    trickleAt = start;
+
+    at.startResponse(NULL, NULL, 0, timeout);
+    at.waitResponse();
+
+    return clockMs - start;
+}
+
+// Response deadline holds across millis() wraparound, and a stalled response
+// ends on its gap timeout.
+static void checkDeadline(void)
+{
+    AtProcess at(discardPut, trickleGet, clockDelay, clockMillis);
+    AtProcessInit init = { "\r", "\nOK\r\n", "ERROR\r\n", NULL, 0, NULL };
+    at.init(&init);
+
+    clockMs = UINT32_MAX - 50;
+    uint32_t took = trickleResponse(at, 1000, 200);
+    check(at.responseStatus().status == AtProcess::TIMEOUT && clockMs < 1000 &&
+          took >= 200 && took <= 202, "deadline across millis() wraparound");
+
+    at.setGapTimeout(30);
+    took = trickleResponse(at, 5, 1000);
+    check(at.responseStatus().status == AtProcess::TIMEOUT && took >= 70 && took <= 72,
+          "gap timeout ends stalled response");
+}
+
+
+// Failed frame is not sent again as AT command, and reset started by the base
+// backend turns frames off.
+static void checkFramedBackend(void)
+{
+    static SimModule framedModule;
+    framedModule.bind();
+
+    static FramedBackend framed(&SimModule::hostInterface);
+    framed.begin();
+    framed.activateModuleRx();
+    check(framed.softRestart() && framed.framesEnabled(), "framed restart");
+
+    uint32_t commandsBefore = framedModule.stats().commands;
+    uint8_t buff[4] = { 0 };
+    check(framed.readChar(9, 9, buff, sizeof(buff)) == -1 &&
+          !framed.writeChar(9, 9, buff, 1) &&
+          framedModule.stats().commands == commandsBefore + 2 && framed.framesEnabled(),
+          "frame errors not sent again");
+
+    SimpleBLEBackend &base = framed;
+    base.hardResetModule();
+    check(!framed.framesEnabled(), "base reset turns frames off");
+}
+
+int main(void)
+{
+    checkUrcTable();
+    checkPipeline();
+    checkDeadline();
+    checkFramedBackend();
+
+    static SimModule module;
+    module.bind();
+
+    static SimpleBLE ble(&SimModule::hostInterface);
+
+    check(ble.begin(115200), "begin");
+    check(module.baud() == 115200 && module.hostBaud() == 115200, "baud negotiated");
+
+    SimpleBLE::TankId readTank = ble.addTank(SimpleBLE::READ, 20);
+    SimpleBLE::TankId writeTank = ble.addTank(SimpleBLE::WRITE, 20);
+    check(readTank == 0 && writeTank == 1, "addTank");
+
+    check(ble.writeTank(readTank, "hello"), "writeTank");
+    uint8_t peerData[20];
+    check(module.peerRead(0, readTank, peerData, sizeof(peerData)) == 5 &&
+          !memcmp(peerData, "hello", 5), "peer sees written data");
+
+    check(ble.startAdvertisement(100, SIMPLEBLE_INFINITE_ADVERTISEMENT_DURATION, true) &&
+          module.advertising(), "startAdvertisement");
+
+    module.peerWrite(0, writeTank, (const uint8_t*)"abc", 3);
+    SimpleBLE::TankId updated = SimpleBLE::INVALID_TANK_ID;
+    uint32_t updateSize = 0;
+    check(ble.waitUpdates(&updated, &updateSize, 100) &&
+          updated == writeTank && updateSize == 3, "waitUpdates");
+
+    uint8_t data[3];
+    uint32_t readLen = 0;
+    check(ble.readTank(writeTank, data, sizeof(data), &readLen) &&
+          readLen == 3 && !memcmp(data, "abc", 3), "readTank");
+
+    uint32_t readStart = module.millis();
+    check(ble.readTank(writeTank, peerData, sizeof(peerData), &readLen) && readLen == 3 &&
+          !memcmp(peerData, "abc", 3) && module.millis() - readStart < 100,
+          "readTank into larger buffer");
+    check(!ble.readTank(writeTank, data, 2, &readLen) && readLen == 3 &&
+          !memcmp(data, "ab", 2) && ble.writeTank(readTank, "ok"),
+          "readTank into smaller buffer");
+
+    check(!ble.waitUpdates(&updated, &updateSize, 50), "no spurious update");
+
+#ifdef SIMPLEBLE_FRAMED_BACKEND
+    check(module.frames() && module.stats().frames == 5, "tank traffic in frames");
+#endif //SIMPLEBLE_FRAMED_BACKEND
+
+    SimpleBLE::TankId latestTank = ble.addTank(SimpleBLE::READ, 4, SimpleBLE::TANK_LATEST_VALUE);
+    uint32_t commandsBefore = module.stats().commands;
+    bool staged = true;
+    for(uint8_t sample = 0; sample < 10; sample++)
+    {
+        staged &= ble.writeTank(latestTank, &sample, 1);
+    }
+    check(staged && module.stats().commands == commandsBefore, "latest value staged");
+    check(ble.flushTanks() && module.stats().commands == commandsBefore + 1 &&
+          module.peerRead(0, latestTank, peerData, sizeof(peerData)) == 1 &&
+          peerData[0] == 9, "latest value flushed");
+    check(ble.flushTanks() && module.stats().commands == commandsBefore + 1,
+          "clean tanks not flushed");
+
+    SimpleBLE::TankId shadowTank = ble.addTank(SimpleBLE::WRITE, 4, SimpleBLE::TANK_SHADOW);
+    check(ble.writeTank(shadowTank, "ab") && ble.writeTank(shadowTank, "ab") &&
+          module.stats().commands == commandsBefore + 3, "same value written once");
+    check(ble.readTank(shadowTank, data, sizeof(data), &readLen) && readLen == 2 &&
+          !memcmp(data, "ab", 2) && module.stats().commands == commandsBefore + 3,
+          "read served from shadow");
+    module.peerWrite(0, shadowTank, (const uint8_t*)"xyz", 3);
+    module.advance(5000);
+    check(ble.readTank(shadowTank, data, sizeof(data), &readLen) && readLen == 3 &&
+          !memcmp(data, "xyz", 3) && module.stats().commands == commandsBefore + 4,
+          "client write invalidates shadow");
+
+    check(ble.softRestart() && module.baud() == 115200 &&
+          module.hostBaud() == 115200, "baud negotiated after restart");
+
+    printf("commands %u, partial batches %u, time %u ms\n",
+           module.stats().commands, module.stats().partialBatches,
+           module.millis());
+
+    // Host lost the negotiated speed, as if only the host restarted. Restart
+    // command times out, and after reset ^START is waited for only once.
+    module.hostSetBaud(SIM_DEFAULT_BAUD);
+    uint32_t beginStart = module.millis();
+    check(ble.begin(115200) && module.baud() == 115200 &&
+          module.millis() - beginStart < 5000, "begin after host restart");
+
+    // Host that can't go as fast as the module settles on its own limit.
+    SimModuleConfig slowHostConfig = { SIM_DEFAULT_BAUD, 2000, 300, 50, 10, 56000 };
+    static SimModule slowHostModule(&slowHostConfig);
+    slowHostModule.bind();
+
+    static SimpleBLE slowHostBle(&SimModule::hostInterface);
+    check(slowHostBle.begin(1000000) && slowHostModule.baud() == 56000 &&
+          slowHostModule.stats().garbledBytes == 0, "baud limited by host");
+
+    return failures ? 1 : 0;
+}
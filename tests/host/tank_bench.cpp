@@ -0,0 +1,186 @@
+#include "simple_ble.h"
+#include "sim_module.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Throughput and latency of tank operations against the simulated module,
+ * swept over baud rate and payload size. Times are virtual, so results are
+ * repeatable and only change with the library or the simulator. Build as
+ * described in sim_module.h, with this file as the test. Output is CSV:
+ *
+ *   op,baud,payload,ops,cmd_per_s,payload_b_per_s,p50_us,p99_us,max_us
+ *
+ * begin   SimpleBLE::begin() on a running module, negotiating baud rate
+ *         up from default 9600.
+ * write   writeTank() of payload bytes.
+ * read    readTank() of payload bytes.
+ * update  Peer write until its data is read with waitUpdates() and
+ *         readTank(), like manageUpdates() does on Arduino.
+ */
+
+
+#define BENCH_OPS                                                   (100)
+#define BENCH_BEGIN_OPS                                             (5)
+
+static const uint32_t bauds[] = { 9600, 115200, 1000000 };
+static const uint32_t payloads[] = { 1, 20, 64, 244, 512 };
+
+
+struct BenchRun
+{
+    SimModule *module;
+    uint64_t startUs;
+    uint32_t startCommands;
+    uint32_t ops;
+    uint32_t latencies[BENCH_OPS];
+};
+
+
+static int compareLatency(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t*)a;
+    uint32_t lb = *(const uint32_t*)b;
+
+    return la < lb ? -1 : la > lb ;
+}
+
+static void startRun(BenchRun *run, SimModule *module)
+{
+    run->module = module;
+    run->startUs = module->micros();
+    run->startCommands = module->stats().commands;
+    run->ops = 0;
+}
+
+static void addLatency(BenchRun *run, uint64_t opStartUs)
+{
+    run->latencies[run->ops++] = run->module->micros() - opStartUs;
+}
+
+static void report(BenchRun *run, const char *op, uint32_t baud, uint32_t payload)
+{
+    double seconds = (run->module->micros() - run->startUs) / 1e6;
+    uint32_t commands = run->module->stats().commands - run->startCommands;
+
+    qsort(run->latencies, run->ops, sizeof(run->latencies[0]), compareLatency);
+
+    printf("%s,%u,%u,%u,%.1f,%.1f,%u,%u,%u\n",
+           op, baud, payload, run->ops,
+           seconds > 0 ? commands / seconds : 0,
+           seconds > 0 ? (double)run->ops * payload / seconds : 0,
+           run->latencies[run->ops / 2],
+           run->latencies[(run->ops * 99) / 100],
+           run->latencies[run->ops - 1]);
+}
+
+static bool benchBaud(uint32_t baud)
+{
+    SimModuleConfig config = { SIM_DEFAULT_BAUD, 2000, 300, 50, 10, 0 };
+    SimModule *module = new SimModule(&config);
+    module->bind();
+
+    SimpleBLE *ble = new SimpleBLE(&SimModule::hostInterface);
+    BenchRun run;
+    bool retval = false;
+
+do{
+    startRun(&run, module);
+    for(uint32_t i = 0; i < BENCH_BEGIN_OPS; i++)
+    {
+        uint64_t opStart = module->micros();
+
+        if( !ble->begin(baud) || module->baud() != baud )
+        {
+            fprintf(stderr, "begin failed at %u baud\n", baud);
+            break;
+        }
+        addLatency(&run, opStart);
+    }
+    if( run.ops != BENCH_BEGIN_OPS )
+    {
+        break;
+    }
+    report(&run, "begin", baud, 0);
+
+    SimpleBLE::TankId tanks[sizeof(payloads)/sizeof(payloads[0])];
+    for(uint8_t p = 0; p < sizeof(payloads)/sizeof(payloads[0]); p++)
+    {
+        tanks[p] = ble->addTank(SimpleBLE::WRITE, payloads[p]);
+    }
+
+    static uint8_t data[SIM_MAX_CHAR_SIZE_B];
+    static uint8_t readBack[SIM_MAX_CHAR_SIZE_B];
+
+    for(uint8_t p = 0; p < sizeof(payloads)/sizeof(payloads[0]); p++)
+    {
+        uint32_t payload = payloads[p];
+        SimpleBLE::TankId tank = tanks[p];
+
+        startRun(&run, module);
+        for(uint32_t i = 0; i < BENCH_OPS; i++)
+        {
+            memset(data, i, payload);
+
+            uint64_t opStart = module->micros();
+            ble->writeTank(tank, data, payload);
+            addLatency(&run, opStart);
+        }
+        report(&run, "write", baud, payload);
+
+        startRun(&run, module);
+        for(uint32_t i = 0; i < BENCH_OPS; i++)
+        {
+            uint64_t opStart = module->micros();
+            ble->readTank(tank, readBack, payload);
+            addLatency(&run, opStart);
+        }
+        report(&run, "read", baud, payload);
+
+        startRun(&run, module);
+        for(uint32_t i = 0; i < BENCH_OPS; i++)
+        {
+            SimpleBLE::TankId updated;
+            uint32_t updateSize;
+
+            memset(data, i, payload);
+
+            uint64_t opStart = module->micros();
+            module->peerWrite(0, tank, data, payload);
+
+            if( ble->waitUpdates(&updated, &updateSize, 1000) )
+            {
+                ble->readTank(updated, readBack, updateSize);
+            }
+            addLatency(&run, opStart);
+        }
+        report(&run, "update", baud, payload);
+    }
+
+    retval = true;
+}while(0);
+
+    delete ble;
+    delete module;
+
+    return retval;
+}
+
+
+int main(void)
+{
+    bool retval = true;
+
+    printf("op,baud,payload,ops,cmd_per_s,payload_b_per_s,p50_us,p99_us,max_us\n");
+
+    for(uint8_t b = 0; b < sizeof(bauds)/sizeof(bauds[0]); b++)
+    {
+        retval &= benchBaud(bauds[b]);
+    }
+
+    return retval ? 0 : 1;
+}
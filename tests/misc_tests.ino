@@ -43,8 +43,6 @@ void bleReset()
 
 void setup()
 {
-    Timeout::init(millis);
-
     pinMode(RX_ENABLE_PIN, OUTPUT);
     pinMode(MODULE_RESET_PIN, OUTPUT);
 